@@ -0,0 +1,429 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "buffer.hpp"
+#include "commands.hpp"
+#include "crc.hpp"
+#include "file.hpp"
+#include "flasher.hpp"
+#include "logger.hpp"
+#include "nvr.hpp"
+#include "sector.hpp"
+#include "serif.hpp"
+#include "simulator.hpp"
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+using bench_clock = std::chrono::steady_clock;
+
+constexpr size_t bench_commands = 20000;
+constexpr size_t bench_windows[] = {1, 4, 16, 64};
+constexpr size_t flash_size = 64 * 2048;
+constexpr size_t sector_size = 2048;
+constexpr size_t nvr_crc_runs = 1000;
+
+struct {
+  size_t iterations = 100;
+  std::chrono::microseconds latency{200};
+  unsigned int baud = 0;
+  std::vector<size_t> windows = {1, 16};
+} args;
+
+// Every heap allocation made while a benchmark runs is counted
+std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+// Master side of a pseudo terminal that either swallows or echoes
+// everything written to the slave side
+class pty_stub {
+public:
+  pty_stub(bool echo) : m_echo(echo) {
+    m_master = posix_openpt(O_RDWR | O_NOCTTY);
+    grantpt(m_master);
+    unlockpt(m_master);
+    m_name = ptsname(m_master);
+    m_thread = std::thread([this]() { _run(); });
+  }
+
+  ~pty_stub() {
+    m_stop = true;
+    m_thread.join();
+    close(m_master);
+  }
+
+  const char *slave_name() { return m_name.c_str(); }
+
+private:
+  void _run() {
+    std::byte data[4096];
+    struct pollfd pfd = {m_master, POLLIN, 0};
+    while (!m_stop) {
+      if (poll(&pfd, 1, 10) <= 0) {
+        continue;
+      }
+      ssize_t n = ::read(m_master, data, sizeof(data));
+      if (n > 0 && m_echo) {
+        ::write(m_master, data, n);
+      }
+    }
+  }
+
+  int m_master;
+  bool m_echo;
+  std::string m_name;
+  std::atomic<bool> m_stop{false};
+  std::thread m_thread;
+};
+
+json result(std::string name, size_t commands, size_t writes,
+            bench_clock::time_point start) {
+  double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  return {{"name", name},
+          {"commands", commands},
+          {"writes", writes},
+          {"writes_per_command", static_cast<double>(writes) / commands},
+          {"seconds", seconds},
+          {"commands_per_s", commands / seconds}};
+}
+
+int open_raw(const char *name) {
+  int fd = ::open(name, O_RDWR | O_NOCTTY);
+  struct termios tty;
+  tcgetattr(fd, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(fd, TCSANOW, &tty);
+  return fd;
+}
+
+// Previous TX path: one write() per byte
+json bench_tx_per_byte() {
+  pty_stub stub(false);
+  int fd = open_raw(stub.slave_name());
+  buffer cmd(CMD_CONT_WRITE_SRAM);
+  size_t writes = 0;
+  auto start = bench_clock::now();
+  for (size_t i = 0; i < bench_commands; i++) {
+    for (size_t b = 0; b < 4; b++) {
+      ::write(fd, &cmd.data()[b], 1);
+      writes++;
+    }
+  }
+  tcdrain(fd);
+  json j = result("tx_per_byte", bench_commands, writes, start);
+  close(fd);
+  return j;
+}
+
+// Current TX path without replies: one write() per command
+json bench_tx_per_command(log_t log) {
+  pty_stub stub(false);
+  serif port(stub.slave_name(), log);
+  port.open(10);
+  buffer cmd(CMD_CONT_WRITE_SRAM);
+  auto start = bench_clock::now();
+  for (size_t i = 0; i < bench_commands; i++) {
+    port.write_raw(cmd.data(), 4);
+  }
+  return result("tx_per_command", bench_commands, port.stats().tx_writes,
+                start);
+}
+
+// SRAM load as done by flasher::_write_sector, echoed by the stub
+json bench_tx_window(log_t log, size_t window) {
+  pty_stub stub(true);
+  serif port(stub.slave_name(), log);
+  port.open(10);
+  port.set_window(window);
+  buffer cmd(CMD_CONT_WRITE_SRAM);
+  auto start = bench_clock::now();
+  for (size_t i = 0; i < bench_commands; i++) {
+    if (!port.queue_write_cmd(cmd)) {
+      break;
+    }
+  }
+  port.flush();
+  return result("sram_load_window_" + std::to_string(window),
+                port.stats().commands, port.stats().tx_writes, start);
+}
+
+// Firmware like test image: code at the start, 0xFF filled gaps and an
+// unused tail
+std::vector<std::byte> test_image() {
+  std::mt19937 rng(1);
+  std::vector<std::byte> image(flash_size / 2);
+  for (size_t i = 0; i < image.size(); i++) {
+    bool gap = (i % 8192) > 6144;
+    image[i] = gap ? std::byte{0xFF} : static_cast<std::byte>(rng());
+  }
+  return image;
+}
+
+json micro(std::string name, size_t bytes, std::function<void()> run) {
+  size_t allocs = allocations;
+  auto start = bench_clock::now();
+  for (size_t i = 0; i < args.iterations; i++) {
+    run();
+  }
+  double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  return {{"name", name},
+          {"iterations", args.iterations},
+          {"bytes", bytes},
+          {"seconds", seconds},
+          {"bytes_per_s", bytes * args.iterations / seconds},
+          {"gbytes_per_s", bytes * args.iterations / seconds / 1e9},
+          {"allocations", (allocations - allocs) / args.iterations}};
+}
+
+json bench_micro(log_t log) {
+  json j;
+  std::vector<std::byte> flash(flash_size, std::byte{0xFF});
+  std::vector<std::byte> image = test_image();
+  std::copy(image.begin(), image.end(), flash.begin());
+  auto *raw = reinterpret_cast<unsigned char *>(flash.data());
+
+  volatile uint32_t sink = 0;
+  const crc::variant_t variants[] = {crc::CRC_BITWISE, crc::CRC_TABLE,
+                                     crc::CRC_SLICE8, crc::CRC_PCLMUL,
+                                     crc::CRC_AUTO};
+  const uint32_t crc32_reference =
+      crc::crc32(raw, flash_size - 4, crc::CRC_BITWISE);
+  const uint16_t crc16_reference =
+      crc::crc16(raw, flash_size, crc::CRC_BITWISE);
+  for (crc::variant_t variant : variants) {
+    std::string name = crc::variant_name(variant);
+    j.push_back(micro("crc32_" + name, flash_size - 4, [&]() {
+      sink = crc::crc32(raw, flash_size - 4, variant);
+    }));
+    j.back()["identical"] = (sink == crc32_reference);
+    j.push_back(micro("crc16_" + name, flash_size, [&]() {
+      sink = crc::crc16(raw, flash_size, variant);
+    }));
+    j.back()["identical"] = (sink == crc16_reference);
+  }
+  j.push_back({{"name", "crc_pclmul_supported"},
+               {"value", crc::has_pclmul()}});
+  // The NVR CRC only covers a few bytes, so run it over many offsets
+  const size_t nvr_crc_size = sizeof(nvr_config_t::crc_protected);
+  j.push_back(micro("crc16_nvr", nvr_crc_runs * nvr_crc_size, [&]() {
+    for (size_t i = 0; i < nvr_crc_runs; i++) {
+      sink = crc::crc16(raw + i, nvr_crc_size);
+    }
+  }));
+
+  std::vector<sector_step_t> steps;
+  size_t planned = 0;
+  j.push_back(micro("sector_plan", flash_size, [&]() {
+    planned = 0;
+    for (size_t sector = 0; sector < flash_size / sector_size; sector++) {
+      sector::plan(&flash[sector * sector_size], sector_size, steps);
+      planned += steps.size();
+    }
+  }));
+  j.back()["commands"] = planned;
+
+  zw500 device(zw500_timing_t{}, log);
+  std::vector<std::byte> nvr(device.nvr().begin() + NVR_START,
+                             device.nvr().end());
+  std::string preset;
+  nvr::export_preset(log, preset, nvr);
+  std::vector<std::byte> preset_bytes(
+      reinterpret_cast<const std::byte *>(preset.data()),
+      reinterpret_cast<const std::byte *>(preset.data() + preset.size()));
+  j.push_back(micro("nvr_export_preset", nvr.size(), [&]() {
+    std::string out;
+    nvr::export_preset(log, out, nvr);
+  }));
+  j.push_back(micro("nvr_set_preset", preset.size(), [&]() {
+    nvr::set_preset(log, nvr, preset_bytes);
+  }));
+
+  char path[] = "/tmp/zft-bench-XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  j.push_back(micro("file_dump", flash_size,
+                    [&]() { file::dump(log, path, flash); }));
+  j.push_back(micro("file_load", flash_size, [&]() {
+    std::vector<std::byte> in;
+    file::load(log, path, in);
+  }));
+  unlink(path);
+  return j;
+}
+
+json phase(std::string name, flasher &zft, std::function<bool()> run,
+           size_t bytes) {
+  size_t commands = zft.stats().commands;
+  size_t allocs = allocations;
+  auto start = bench_clock::now();
+  bool ok = run();
+  double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  commands = zft.stats().commands - commands;
+  return {{"name", name},
+          {"ok", ok},
+          {"seconds", seconds},
+          {"commands", commands},
+          {"bytes", bytes},
+          {"commands_per_s", commands / seconds},
+          {"bytes_per_s", bytes / seconds},
+          {"allocations", allocations - allocs}};
+}
+
+// Full connect, erase, write, read and verify cycle against zft-sim
+json bench_protocol(log_t log, size_t window) {
+  simulator_config_t config;
+  config.latency = args.latency;
+  config.baud = args.baud;
+  config.timing = {std::chrono::microseconds(0), std::chrono::microseconds(0),
+                   std::chrono::microseconds(0)};
+  simulator sim(config, log);
+  sim.start();
+
+  flasher zft(sim.port().c_str(), log);
+  zft.set_window(window);
+  std::vector<std::byte> image = test_image();
+  std::vector<std::byte> readback;
+
+  json phases;
+  phases.push_back(phase("connect", zft, [&]() { return zft.connect(10); }, 0));
+  phases.push_back(phase("erase", zft, [&]() { return zft.erase_flash(); }, 0));
+  phases.push_back(phase(
+      "write", zft,
+      [&]() { return zft.write_flash(image, 0, FLASH_SECTORS); }, flash_size));
+  phases.push_back(phase(
+      "read", zft,
+      [&]() { return zft.read_flash(readback, 0, FLASH_SECTORS); },
+      flash_size));
+  phases.push_back(phase(
+      "verify", zft,
+      [&]() { return zft.verify_flash(readback, VERIFY_FULL, 100); },
+      flash_size));
+
+  double total = 0;
+  for (auto &p : phases) {
+    total += p["seconds"].get<double>();
+  }
+  return {{"name", "cycle_window_" + std::to_string(window)},
+          {"window", window},
+          {"latency_us", args.latency.count()},
+          {"baud", args.baud},
+          {"seconds", total},
+          {"phases", phases}};
+}
+
+std::vector<size_t> parse_list(const char *list) {
+  std::vector<size_t> values;
+  std::string entry;
+  std::istringstream ss(list);
+  while (std::getline(ss, entry, ',')) {
+    values.push_back(static_cast<size_t>(atoi(entry.c_str())));
+  }
+  return values;
+}
+
+void print_help(const char *exec_name) {
+  std::cout << "Usage: " << exec_name
+            << " -n <iterations> -l <us> -b <baud> -w <list>" << std::endl
+            << "        -n <iterations> Micro benchmark iterations "
+               "(default 100)"
+            << std::endl
+            << "        -l <us>         Simulated command latency "
+               "(default 200)"
+            << std::endl
+            << "        -b <baud>       Simulated baud rate (default 0 = off)"
+            << std::endl
+            << "        -w <list>       Command windows to run the protocol "
+               "cycle with (default 1,16)"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  log_t log(new logger(logger::LOG_ERROR));
+  json j;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:b:w:h?")) != -1) {
+    switch (opt) {
+    case 'n':
+      args.iterations = static_cast<size_t>(std::max(1, atoi(optarg)));
+      break;
+    case 'l':
+      args.latency = std::chrono::microseconds(atoi(optarg));
+      break;
+    case 'b':
+      args.baud = static_cast<unsigned int>(atoi(optarg));
+      break;
+    case 'w':
+      args.windows = parse_list(optarg);
+      break;
+    default:
+      print_help(argv[0]);
+      exit(0);
+    }
+  }
+
+  // flasher reports progress on stdout, keep that away from the JSON
+  std::streambuf *out = std::cout.rdbuf(std::cerr.rdbuf());
+
+  j["micro"] = bench_micro(log);
+  for (size_t window : args.windows) {
+    j["protocol"].push_back(bench_protocol(log, window));
+  }
+  j["tx"].push_back(bench_tx_per_byte());
+  j["tx"].push_back(bench_tx_per_command(log));
+  for (size_t window : bench_windows) {
+    j["tx"].push_back(bench_tx_window(log, window));
+  }
+
+  std::cout.rdbuf(out);
+  std::cout << j.dump(4) << std::endl;
+  return 0;
+}
@@ -18,8 +18,10 @@
 #ifndef INC_CRC
 #define INC_CRC
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <utility>
 
 template <typename T>
 T _crc_generic(unsigned char *data, size_t size, T crc_start, T crc_polynom) {
@@ -40,8 +42,118 @@ T _crc_generic(unsigned char *data, size_t size, T crc_start, T crc_polynom) {
 }
 
 namespace crc {
+typedef enum {
+  CRC_AUTO = 0, // Fastest variant available for the size
+  CRC_BITWISE,  // _crc_generic, one shift and compare per bit
+  CRC_TABLE,    // One table lookup per byte
+  CRC_SLICE8,   // Eight table lookups per eight bytes
+  CRC_PCLMUL    // Carry-less multiply folding, slice8 without CPU support
+} variant_t;
+
 uint16_t crc16(unsigned char *data, size_t size);
 uint32_t crc32(unsigned char *data, size_t size);
+uint16_t crc16(unsigned char *data, size_t size, variant_t variant);
+uint32_t crc32(unsigned char *data, size_t size, variant_t variant);
+const char *variant_name(variant_t variant);
+bool has_pclmul();
 } // namespace crc
 
+// Folds blocks of 16 bytes (at least four) into a 128 bit remainder that is
+// congruent modulo the polynomial. init is xored into the first eight bytes.
+void _crc_fold_pclmul(const unsigned char *data, size_t blocks, uint64_t init,
+                      const uint64_t *constants, unsigned char *remainder);
+
+// Non-reflected, MSB first CRC of up to 32 bits
+template <typename T, T Polynom> class crc_engine {
+public:
+  static constexpr unsigned int width = sizeof(T) * 8;
+
+  static T bytewise(T crc, const unsigned char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      unsigned char index = static_cast<unsigned char>(crc >> (width - 8));
+      crc = static_cast<T>(crc << 8) ^ tables[0][index ^ data[i]];
+    }
+    return crc;
+  }
+
+  static T slice8(T crc, const unsigned char *data, size_t size) {
+    for (; size >= 8; size -= 8, data += 8) {
+      crc = _slice(crc, data, std::make_index_sequence<8>{});
+    }
+    return bytewise(crc, data, size);
+  }
+
+  static T pclmul(T crc, const unsigned char *data, size_t size) {
+    if (size < 64 || !crc::has_pclmul()) {
+      return slice8(crc, data, size);
+    }
+    size_t blocks = size / 16;
+    unsigned char remainder[16];
+    _crc_fold_pclmul(data, blocks, static_cast<uint64_t>(crc) << (64 - width),
+                     fold_constants.data(), remainder);
+    return slice8(slice8(0, remainder, sizeof(remainder)), data + blocks * 16,
+                  size - blocks * 16);
+  }
+
+private:
+  using tables_t = std::array<std::array<T, 256>, 8>;
+
+  // The current CRC overlaps the first bytes of every eight byte step
+  template <size_t I>
+  static unsigned char _index(T crc, const unsigned char *data) {
+    if constexpr (I < sizeof(T)) {
+      return data[I] ^ static_cast<unsigned char>(crc >> (width - 8 * (I + 1)));
+    } else {
+      return data[I];
+    }
+  }
+
+  // Unrolled at compile time, one lookup per byte into its own table
+  template <size_t... I>
+  static T _slice(T crc, const unsigned char *data,
+                  std::index_sequence<I...>) {
+    return (tables[7 - I][_index<I>(crc, data)] ^ ...);
+  }
+
+  // tables[k][b] is the CRC of byte b followed by k zero bytes
+  static constexpr tables_t _make_tables() {
+    tables_t t{};
+    for (unsigned int b = 0; b < 256; b++) {
+      T crc = static_cast<T>(b << (width - 8));
+      for (unsigned int bit = 0; bit < 8; bit++) {
+        crc = (crc >> (width - 1)) ? static_cast<T>((crc << 1) ^ Polynom)
+                                   : static_cast<T>(crc << 1);
+      }
+      t[0][b] = crc;
+    }
+    for (unsigned int k = 1; k < 8; k++) {
+      for (unsigned int b = 0; b < 256; b++) {
+        T prev = t[k - 1][b];
+        t[k][b] = static_cast<T>(prev << 8) ^ t[0][prev >> (width - 8)];
+      }
+    }
+    return t;
+  }
+
+  // x^n mod Polynom
+  static constexpr uint64_t _x_pow_mod(unsigned int n) {
+    uint64_t r = 1;
+    for (unsigned int i = 0; i < n; i++) {
+      r <<= 1;
+      if (r >> width) {
+        r ^= (uint64_t{1} << width) | Polynom;
+      }
+    }
+    return r;
+  }
+
+  static constexpr tables_t tables = _make_tables();
+
+  // Pairs for folding the high and low half of a lane over 512, 384, 256
+  // and 128 bits
+  static constexpr std::array<uint64_t, 8> fold_constants = {
+      _x_pow_mod(576), _x_pow_mod(512), _x_pow_mod(448), _x_pow_mod(384),
+      _x_pow_mod(320), _x_pow_mod(256), _x_pow_mod(192), _x_pow_mod(128)};
+};
+
 #endif /* INC_CRC */
@@ -0,0 +1,31 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_FILE
+#define INC_FILE
+
+#include <cstddef>
+#include <vector>
+
+#include "logger.hpp"
+
+namespace file {
+bool load(log_t log, const char *file, std::vector<std::byte> &out_vector);
+bool dump(log_t log, const char *file, std::vector<std::byte> &buffer);
+} // namespace file
+
+#endif /* INC_FILE */
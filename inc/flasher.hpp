@@ -20,43 +20,160 @@
 
 #include "buffer.hpp"
 #include "logger.hpp"
+#include "nvr_cache.hpp"
+#include "sector.hpp"
 #include "serif.hpp"
+#include <array>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <memory>
 
+#define FLASH_SECTORS 64
+#define FLASH_SECTOR_SIZE 2048
+
+typedef enum {
+  VERIFY_FULL,    // Read back the whole flash
+  VERIFY_WRITTEN, // Read back the sectors programmed by this run
+  VERIFY_SAMPLED, // Read back a random share of the sectors
+  VERIFY_CRC      // Trust the on-chip CRC check after writing
+} verify_policy_t;
+
+typedef enum {
+  POLL_PROGRAM,    // Sector program from SRAM
+  POLL_ERASE,      // Sector erase
+  POLL_CHIP_ERASE, // Chip erase
+  POLL_CRC,        // On-chip CRC check
+  POLL_LOCKBITS,   // Lock byte program
+  POLL_IDLE,       // Nothing running, the first poll should succeed
+  POLL_OPS
+} poll_op_t;
+
 class flasher {
 public:
   flasher(const char *serif, log_t log);
   ~flasher() = default;
   bool connect(unsigned char timeout);
-  bool write_flash(std::vector<std::byte> &flash, size_t sector_offset);
-  bool read_flash(std::vector<std::byte> &flash, size_t sector_offset);
-  bool verify_flash(std::vector<std::byte> &flash);
+  bool wait_for_device(std::chrono::steady_clock::time_point deadline);
+  void set_window(size_t depth);
+  void set_low_latency(bool enable);
+  void set_fail_fast(bool enable);
+  // Time each phase may take, begin_phase starts the clock
+  void set_phase_budget(std::chrono::milliseconds budget);
+  void begin_phase();
+  // Takes the NVR from copies in dir for chips seen before
+  void set_nvr_cache(const std::string &dir);
+  // Modem line steps that hold the chip in programming mode before the
+  // handshake and let it run again after reset
+  void set_reset_lines(const std::vector<serif_line_step_t> &enter,
+                       const std::vector<serif_line_step_t> &release);
+  // Called after each sector was programmed and its state confirmed, the
+  // write stops when it returns false
+  void set_sector_hook(std::function<bool(size_t)> hook);
+  bool set_line(const serif_line_t &line);
+  bool record(const std::string &file);
+  bool replay(const std::string &file, bool realtime);
+  bool probe(unsigned char timeout, std::vector<unsigned int> bauds);
+  bool write_flash(std::vector<std::byte> &flash, size_t sector_offset,
+                   size_t sector_count);
+  // Leaves the CRC check to the caller, a failed one voids the journal
+  bool resume_flash(std::vector<std::byte> &flash, size_t sector_offset);
+  bool write_flash_diff(std::vector<std::byte> &flash,
+                        std::vector<std::byte> &baseline);
+  bool read_flash(std::vector<std::byte> &flash, size_t sector_offset,
+                  size_t sector_count);
+  bool verify_flash(std::vector<std::byte> &flash, verify_policy_t policy,
+                    unsigned int coverage);
+  bool check_identical(std::vector<std::byte> &flash, bool &identical);
   bool erase_flash();
   bool read_nvr(std::vector<std::byte> &nvr);
   bool set_nvr(std::vector<std::byte> &nvr);
   bool read_lockbits(std::vector<std::byte> &lockbits);
   bool set_lockbits(std::vector<std::byte> &lockbits);
   bool check_crc();
+  // Signature and UUID, naming the chip rather than the port it is on
+  bool chip_identity(std::vector<std::byte> &identity);
   bool disable_apm();
   bool reset();
+  void report_stats();
+  const serif_stats_t &stats();
 
 private:
   bool _read_signature();
   bool _write_cmd(std::string out_msg, buffer &buf);
   bool _read_cmd(std::string out_msg, buffer &buf);
+  bool _retry(const std::string &what, std::function<bool()> op);
+  bool _resync();
+  bool _enable();
+  bool _queue_read_cmd(std::string out_msg, buffer &buf,
+                       std::function<void(buffer &)> on_reply);
+  void _prepare_image(std::vector<std::byte> &flash);
+  bool _read_sectors(size_t first, size_t count, std::vector<std::byte> &out);
+  bool _write_sectors(const std::vector<size_t> &sectors, bool erase);
+  bool _write_sector_retry(unsigned int sector, bool erase);
   bool _write_sector(unsigned int sector, std::byte *in_buf,
-                     unsigned int length);
+                     unsigned int length, bool full);
   bool _write_single_byte(unsigned int address, std::byte byte);
   bool _write_byte_block(std::byte byte1, std::byte byte2, std::byte byte3);
-  bool _write_flash(unsigned int sector, unsigned int retry);
+  bool _write_flash(unsigned int sector);
+  bool _erase_sector(unsigned int sector);
+  void _report_plan(size_t sectors);
+  void _check(size_t position, std::byte data);
+  bool _verify_range(size_t first, size_t count);
+  bool _verify_read(size_t first, size_t count);
+  bool _verify_retry(size_t first, size_t count);
+  bool _verify_sectors(std::vector<std::byte> &flash,
+                       const std::vector<size_t> &sectors);
+  void _changed(const std::vector<std::byte> &known,
+                const std::vector<std::byte> &want, size_t count,
+                std::vector<size_t> &changed);
+  bool _read_nvr(const std::vector<size_t> &offsets,
+                 std::vector<std::byte> &data);
+  bool _read_cached_nvr(std::vector<std::byte> &nvr);
+  void _store_nvr();
+  bool _read_lockbits(const std::vector<size_t> &offsets,
+                      std::vector<std::byte> &data);
+  bool _check_written(const std::string &what,
+                      const std::vector<size_t> &offsets,
+                      const std::vector<std::byte> &want,
+                      const std::vector<std::byte> &data);
   bool _get_state_byte(std::byte &state_byte);
-  bool _check_state(unsigned int retry, std::byte mask, bool state);
+  double _round_trip_us();
+  size_t _bytes_per_second();
+  bool _check_state(poll_op_t op, std::byte mask, bool state);
   bool _generate_crc32();
+  void _report_throughput(std::string phase,
+                          std::chrono::steady_clock::time_point start,
+                          size_t commands, size_t bytes);
 
   serif m_serif;
   log_t m_log;
   std::vector<std::byte> m_file_buffer;
+  std::vector<sector_step_t> m_steps;
+  size_t m_plan_commands = 0;
+  size_t m_plan_linear = 0;
+  std::vector<size_t> m_written;
+  std::vector<size_t> m_range;
+  std::vector<std::pair<size_t, size_t>> m_mismatches;
+  std::byte m_mismatch_data{0};
+  // Device NVR and lock bytes as last read or written, empty if unknown
+  std::vector<std::byte> m_nvr;
+  bool m_nvr_cached = false;
+  std::vector<std::byte> m_signature;
+  nvr_cache m_nvr_cache;
+  std::vector<std::byte> m_lockbits;
+  bool m_fail_fast = true;
+  std::function<bool(size_t)> m_sector_hook;
+  std::chrono::milliseconds m_budget{0};
+  size_t m_retries = 0;
+  size_t m_sector_retries = 0;
+  size_t m_resyncs = 0;
+  std::array<std::chrono::steady_clock::duration, POLL_OPS> m_wait{};
+  std::array<size_t, POLL_OPS> m_waits{};
+  std::array<size_t, POLL_OPS> m_polls{};
+  bool m_low_latency = false;
+  std::vector<serif_line_step_t> m_enter_lines;
+  std::vector<serif_line_step_t> m_release_lines;
 };
 
 #endif /* INC_FLASHER */
@@ -0,0 +1,72 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_JOURNAL
+#define INC_JOURNAL
+
+#include "logger.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+// Journal files are text. The first line is JOURNAL_MAGIC followed by the
+// image CRC32, the image size and the chip signature and UUID in hex, then
+// one line per confirmed step: "erase", "nvr <crc32> <lockbits>" and
+// "sector <n>". Each line is synced to disk before the job moves on.
+#define JOURNAL_MAGIC "ZFTJOB2"
+
+// Progress of one flash job, so that a job broken off by a link failure
+// can resume without starting over from the chip erase
+class journal {
+public:
+  journal(log_t log);
+  ~journal();
+  // Continues the journal in file if it belongs to the same image and
+  // chip, starts a new one otherwise
+  bool open(const std::string &file, const std::vector<std::byte> &chip,
+            const std::vector<std::byte> &image);
+  bool resumed();
+  size_t next_sector();
+  bool nvr_written(const std::vector<std::byte> &nvr,
+                   std::vector<std::byte> &lockbits);
+  bool erased();
+  bool nvr(const std::vector<std::byte> &nvr,
+           const std::vector<std::byte> &lockbits);
+  bool sector(size_t sector);
+  // Removes the journal once the job is done
+  bool finish();
+  // Removes a journal that does not describe the chip
+  bool discard();
+
+private:
+  bool _load(const std::string &header);
+  bool _append(const std::string &line);
+
+  log_t m_log;
+  std::string m_file;
+  int m_fd = -1;
+  bool m_loaded = false;
+  bool m_erased = false;
+  uint32_t m_nvr = 0;
+  bool m_nvr_written = false;
+  std::vector<std::byte> m_lockbits;
+  std::set<size_t> m_sectors;
+};
+
+#endif /* INC_JOURNAL */
@@ -39,6 +39,11 @@ public:
   std::ostream &warn();
   std::ostream &info();
   std::ostream &debug();
+  // Holds back what the calling thread logs until end_buffer, so tasks on
+  // worker threads neither interleave with nor share stream state with
+  // the main thread
+  void begin_buffer();
+  void end_buffer();
 
 private:
   class _null_buffer : public std::ostream {
@@ -46,8 +51,8 @@ private:
     int overflow(int c);
   };
   std::ostream &_msg(log_level_t level, const char *c_msg);
+  std::ostream &_out();
   log_level_t m_level;
-  _null_buffer m_null_buffer;
 };
 
 using log_t = std::shared_ptr<logger>;
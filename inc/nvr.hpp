@@ -78,6 +78,8 @@ bool set_preset(log_t log, std::vector<std::byte> &nvr,
                 std::vector<std::byte> &preset);
 bool export_preset(log_t log, std::string &of, std::vector<std::byte> &nvr);
 unsigned char get_revision(std::vector<std::byte> &nvr);
+// Whether the stored CRC16 matches the protected area
+bool crc_valid(const std::vector<std::byte> &nvr);
 } // namespace nvr
 
 #endif /* INC_NVR */
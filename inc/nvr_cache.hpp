@@ -0,0 +1,48 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_NVR_CACHE
+#define INC_NVR_CACHE
+
+#include "logger.hpp"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Copies of device NVRs in a directory, one binary file per chip named
+// after its signature and UUID. The flasher only uses a copy while the
+// UUID and CRC16 read from the chip still match it.
+class nvr_cache {
+public:
+  nvr_cache(log_t log);
+  ~nvr_cache() = default;
+  void open(const std::string &dir);
+  bool enabled();
+  // False if there is no copy or it fails its own CRC16
+  bool load(const std::vector<std::byte> &identity,
+            std::vector<std::byte> &nvr);
+  bool store(const std::vector<std::byte> &identity,
+             const std::vector<std::byte> &nvr);
+
+private:
+  std::string _file(const std::vector<std::byte> &identity);
+
+  log_t m_log;
+  std::string m_dir;
+};
+
+#endif /* INC_NVR_CACHE */
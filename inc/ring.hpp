@@ -0,0 +1,68 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_RING
+#define INC_RING
+
+#include <cstddef>
+
+// Fixed-capacity FIFO without heap allocations. Head and tail are free-running
+// indices, so the capacity has to be a power of two.
+template <typename T, size_t N> class ring {
+  static_assert(N && (N & (N - 1)) == 0, "Capacity must be a power of two");
+
+public:
+  size_t size() const { return m_tail - m_head; }
+  size_t capacity() const { return N; }
+  bool empty() const { return m_head == m_tail; }
+  bool full() const { return size() == N; }
+  T &front() { return m_data[m_head & (N - 1)]; }
+  T &operator[](size_t idx) { return m_data[(m_head + idx) & (N - 1)]; }
+
+  bool push_back(const T &value) {
+    if (full()) {
+      return false;
+    }
+    m_data[m_tail++ & (N - 1)] = value;
+    return true;
+  }
+
+  void pop_front(size_t count = 1) {
+    m_head += (count < size()) ? count : size();
+  }
+
+  void clear() { m_head = m_tail; }
+
+  // Linear free space behind the tail, fill it and commit() what was written
+  T *tail(size_t &contiguous) {
+    size_t idx = m_tail & (N - 1);
+    contiguous = N - size();
+    if (contiguous > N - idx) {
+      contiguous = N - idx;
+    }
+    return &m_data[idx];
+  }
+
+  void commit(size_t count) { m_tail += count; }
+
+private:
+  T m_data[N];
+  size_t m_head = 0;
+  size_t m_tail = 0;
+};
+
+#endif /* INC_RING */
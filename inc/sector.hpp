@@ -0,0 +1,54 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_SECTOR
+#define INC_SECTOR
+
+#include <cstddef>
+#include <vector>
+
+typedef enum {
+  SECTOR_WRITE_BYTE,  // WRITE_SRAM of data[0] at address
+  SECTOR_WRITE_BLOCK, // CONT_WRITE_SRAM of data[0..2]
+  SECTOR_PROGRAM      // WRITE_FLASH_SECTOR
+} sector_op_t;
+
+typedef struct {
+  sector_op_t op;
+  unsigned int address;
+  std::byte data[3];
+} sector_step_t;
+
+namespace sector {
+// Commands to program one sector. Leading and trailing 0xFF are skipped,
+// holes of 0xFF inside are jumped over with a new WRITE_SRAM when that is
+// cheaper than streaming them. steps is cleared first so callers can reuse
+// it between sectors.
+void plan(const std::byte *data, unsigned int length,
+          std::vector<sector_step_t> &steps);
+
+// Commands to load every byte of the sector, overwriting whatever a failed
+// load left in SRAM
+void plan_full(const std::byte *data, unsigned int length,
+               std::vector<sector_step_t> &steps);
+
+// Commands the plan would take when streaming everything between the first
+// and the last byte that is not 0xFF
+size_t linear_commands(const std::byte *data, unsigned int length);
+} // namespace sector
+
+#endif /* INC_SECTOR */
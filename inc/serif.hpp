@@ -20,23 +20,101 @@
 
 #include "buffer.hpp"
 #include "logger.hpp"
+#include "ring.hpp"
+#include "transport.hpp"
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
+#include <sys/uio.h>
+#include <vector>
+
+#define SERIF_RX_SIZE 4096
+#define SERIF_MAX_WINDOW 256
+
+typedef struct {
+  size_t commands = 0;
+  std::chrono::nanoseconds total{0}; // Sum of write-to-reply latencies
+  std::chrono::nanoseconds min = std::chrono::nanoseconds::max();
+  std::chrono::nanoseconds max{0};
+  size_t resyncs = 0;       // Replies found at a shifted position
+  size_t dropped_bytes = 0; // Bytes skipped to resynchronise
+  size_t tx_writes = 0;     // write()/writev() calls
+  size_t tx_bytes = 0;
+  size_t timeouts = 0; // Replies that missed their deadline
+} serif_stats_t;
+
+typedef struct {
+  unsigned int set = 0;              // SERIF_LINE_* bits to assert
+  unsigned int clear = 0;            // SERIF_LINE_* bits to release
+  std::chrono::milliseconds hold{0}; // Settling time before the next step
+} serif_line_step_t;
 
 class serif {
 public:
   serif(const char *if_name, log_t log);
-  ~serif();
+  ~serif() = default;
   bool open(unsigned char timeout);
+  // Waits for a hotplugged device, a vanished one is reopened afresh
+  bool wait_present(std::chrono::steady_clock::time_point deadline);
   bool write_cmd(buffer &cmd);
   bool read_cmd(buffer &cmd);
+  bool queue_write_cmd(buffer &cmd);
+  bool queue_read_cmd(buffer &cmd, std::function<void(buffer &)> on_reply);
+  bool flush();
+  bool resync();
+  // Caps every deadline until the next call, zero lifts the cap
+  void begin_phase(std::chrono::milliseconds budget);
+  void set_window(size_t depth);
+  void set_low_latency(bool enable);
+  bool set_line(const serif_line_t &line);
+  // Drives the modem lines step by step, e.g. to hold or release RESET
+  bool run_lines(const std::vector<serif_line_step_t> &steps);
+  bool record(const std::string &file);
+  bool replay(const std::string &file, bool realtime);
+  const serif_line_t &line();
+  const serif_stats_t &stats();
   bool write_raw(std::byte *send, size_t length);
   bool read_raw(std::byte *recv, size_t length);
   size_t bytes_available();
+  // Buffers up to count bytes within timeout, a shortfall is no error
+  size_t wait_bytes(size_t count, std::chrono::milliseconds timeout);
 
 private:
-  int m_serif = 0;
+  typedef struct {
+    buffer cmd;
+    std::function<void(buffer &)> on_reply; // Empty for echoed commands
+    std::chrono::steady_clock::time_point sent;
+  } pending_t;
+
+  bool _queue(buffer &cmd, std::function<void(buffer &)> on_reply);
+  bool _complete_one();
+  bool _write_all(struct iovec *iov, size_t count);
+  bool _send_staged();
+  void _reset_window();
+  std::chrono::steady_clock::time_point _deadline();
+  bool _wait(short events, std::chrono::steady_clock::time_point deadline);
+  bool _fill(std::chrono::steady_clock::time_point deadline);
+  bool _next_frame(buffer &expect, size_t echo_bytes, buffer &reply);
+  size_t _find_frame(buffer &expect, size_t echo_bytes);
+  void _drain();
+  void _record_latency(std::chrono::steady_clock::time_point sent);
+
   std::string m_if_name;
   log_t m_log;
+  std::unique_ptr<transport> m_transport;
+  bool m_open = false;
+  std::chrono::milliseconds m_timeout{0};
+  std::chrono::steady_clock::time_point m_phase_deadline =
+      std::chrono::steady_clock::time_point::max();
+  size_t m_window = 1;
+  bool m_window_auto = false;
+  serif_stats_t m_stats;
+  ring<pending_t, SERIF_MAX_WINDOW> m_pending;
+  size_t m_unsent = 0; // Staged commands at the end of m_pending
+  serif_line_t m_line;
+  bool m_low_latency = false;
+  ring<std::byte, SERIF_RX_SIZE> m_rx;
 };
 
 #endif /* INC_SERIF */
@@ -0,0 +1,116 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_SESSION
+#define INC_SESSION
+
+#include "transport.hpp"
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <vector>
+
+// Session files start with SESSION_MAGIC, followed by records of a type
+// byte, the LEB128 nanoseconds since the previous record, the LEB128 length
+// and the payload.
+#define SESSION_MAGIC "ZFTSES1"
+#define SESSION_TX 0
+#define SESSION_RX 1
+
+// Passes everything through to another transport and records each chunk
+// sent and received with a monotonic timestamp
+class record_transport : public transport {
+public:
+  record_transport(std::unique_ptr<transport> inner, const std::string &file,
+                   log_t log);
+  ~record_transport();
+  bool open(const serif_line_t &line) override;
+  int fd() override;
+  ssize_t read(std::byte *data, size_t length) override;
+  ssize_t writev(const struct iovec *iov, int count) override;
+  size_t bytes_available() override;
+  void drain() override;
+  bool set_line(const serif_line_t &line) override;
+  void set_low_latency(bool enable) override;
+  size_t default_window() override;
+  bool set_modem_lines(unsigned int set, unsigned int clear) override;
+  bool present() override;
+  bool wait_present(std::chrono::steady_clock::time_point deadline) override;
+  // Swaps in a fresh transport after a replug, the recording carries on
+  void set_inner(std::unique_ptr<transport> inner);
+
+private:
+  void _record(unsigned char type, const std::byte *data, size_t length);
+  void _varint(uint64_t value);
+
+  std::unique_ptr<transport> m_inner;
+  std::string m_file;
+  log_t m_log;
+  std::ofstream m_fs;
+  std::chrono::steady_clock::time_point m_last;
+  size_t m_records = 0;
+};
+
+// Plays the received side of a session file back. Replies are released
+// once the bytes that preceded them in the recording have been written,
+// either after the recorded response time or immediately.
+class replay_transport : public transport {
+public:
+  replay_transport(const std::string &file, bool realtime, log_t log);
+  ~replay_transport();
+  bool open(const serif_line_t &line) override;
+  int fd() override;
+  ssize_t read(std::byte *data, size_t length) override;
+  ssize_t writev(const struct iovec *iov, int count) override;
+  size_t bytes_available() override;
+  void drain() override;
+  bool set_line(const serif_line_t &line) override;
+  bool set_modem_lines(unsigned int set, unsigned int clear) override;
+  size_t default_window() override;
+
+private:
+  typedef struct {
+    size_t tx_before;                    // TX bytes recorded before it
+    size_t rx_offset;                    // RX bytes recorded before it
+    std::chrono::nanoseconds response;   // Time since the last TX
+    std::vector<std::byte> data;
+  } rx_record_t;
+
+  typedef struct {
+    std::chrono::steady_clock::time_point due;
+    std::vector<std::byte> data;
+  } rx_chunk_t;
+
+  bool _load();
+  void _schedule();
+  void _arm();
+
+  std::string m_file;
+  bool m_realtime;
+  log_t m_log;
+  int m_timer = -1;
+  std::vector<std::byte> m_tx;
+  std::vector<rx_record_t> m_rx;
+  size_t m_tx_written = 0;
+  size_t m_tx_diverged = 0;
+  size_t m_rx_next = 0;
+  size_t m_rx_next_offset = 0;
+  std::deque<rx_chunk_t> m_due;
+  std::chrono::steady_clock::time_point m_last_due;
+};
+
+#endif /* INC_SESSION */
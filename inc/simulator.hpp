@@ -0,0 +1,86 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_SIMULATOR
+#define INC_SIMULATOR
+
+#include <atomic>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "logger.hpp"
+#include "zw500.hpp"
+
+typedef struct {
+  std::chrono::microseconds latency{0};
+  unsigned int baud = 115200;
+  double bit_error_rate = 0;
+  unsigned int seed = 1;
+  zw500_timing_t timing;
+} simulator_config_t;
+
+typedef struct {
+  size_t commands;
+  size_t bit_errors;
+} simulator_stats_t;
+
+// Serves a zw500 model on the slave side of a pseudo terminal
+class simulator {
+public:
+  simulator(const simulator_config_t &config, log_t log);
+  ~simulator();
+  bool start();
+  void stop();
+  const std::string &port();
+  zw500 &device();
+  simulator_stats_t stats();
+
+private:
+  typedef struct {
+    zw500::clock::time_point due;
+    zw500::frame_t data;
+  } reply_t;
+
+  void _run();
+  void _receive(const std::byte *data, size_t length,
+                zw500::clock::time_point now);
+  void _reply(const zw500::frame_t &cmd, zw500::clock::time_point now);
+  void _send_due(zw500::clock::time_point now);
+
+  simulator_config_t m_config;
+  log_t m_log;
+  zw500 m_device;
+  int m_master = -1;
+  int m_slave = -1;
+  int m_wakeup = -1;
+  std::string m_port;
+  std::thread m_thread;
+  std::atomic<bool> m_running{false};
+  std::mt19937 m_rng;
+  std::bernoulli_distribution m_bit_error;
+  zw500::frame_t m_frame;
+  size_t m_frame_fill = 0;
+  zw500::clock::time_point m_last_rx;
+  zw500::clock::time_point m_wire_free;
+  std::deque<reply_t> m_replies;
+  std::atomic<size_t> m_commands{0};
+  std::atomic<size_t> m_bit_errors{0};
+};
+
+#endif /* INC_SIMULATOR */
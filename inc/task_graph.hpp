@@ -0,0 +1,89 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_TASK_GRAPH
+#define INC_TASK_GRAPH
+
+#include "logger.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef enum {
+  TASK_HOST,  // Files and NVR edits, runs on a worker as soon as it can
+  TASK_DEVICE // Serial link, runs on the calling thread in the added order
+} task_lane_t;
+
+typedef struct {
+  std::string name;
+  task_lane_t lane;
+  std::function<bool()> run;
+  std::vector<const void *> reads;  // Data the task only looks at
+  std::vector<const void *> writes; // Data the task changes
+} task_t;
+
+// Runs a job as a dependency graph. A task waits for the last earlier task
+// writing what it reads or writes and, before a write, for the earlier
+// readers, so the outcome is that of running the tasks one by one in the
+// order they were added. Device tasks also wait for each other.
+class task_graph {
+public:
+  task_graph(log_t log);
+  ~task_graph() = default;
+  void add(const task_t &task);
+  // Called before each device task, on the thread that runs it
+  void set_phase_hook(std::function<void()> hook);
+  // Stops starting tasks at the first failure, running ones are finished
+  bool run();
+  void report();
+
+private:
+  typedef struct {
+    task_t task;
+    std::vector<size_t> deps;
+    bool started = false;
+    bool done = false;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+  } node_t;
+
+  bool _ready(const node_t &node);
+  void _launch_ready();
+  void _execute(size_t index);
+
+  log_t m_log;
+  std::function<void()> m_phase_hook;
+  std::vector<node_t> m_nodes;
+  std::map<const void *, size_t> m_writer;
+  std::map<const void *, std::vector<size_t>> m_readers;
+  size_t m_last_device = SIZE_MAX;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::vector<std::thread> m_workers;
+  size_t m_running = 0;
+  size_t m_done = 0;
+  bool m_failed = false;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+#endif /* INC_TASK_GRAPH */
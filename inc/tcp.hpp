@@ -0,0 +1,66 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_TCP
+#define INC_TCP
+
+#include "transport.hpp"
+#include <vector>
+
+// Serial server in the rack, either a raw TCP byte pipe (tcp://host:port) or
+// a Telnet COM port control server (rfc2217://host:port)
+class tcp_transport : public transport {
+public:
+  tcp_transport(const std::string &host, const std::string &port,
+                bool rfc2217, log_t log);
+  ~tcp_transport();
+  bool open(const serif_line_t &line) override;
+  int fd() override;
+  ssize_t read(std::byte *data, size_t length) override;
+  ssize_t writev(const struct iovec *iov, int count) override;
+  size_t bytes_available() override;
+  void drain() override;
+  bool set_line(const serif_line_t &line) override;
+  size_t default_window() override;
+
+private:
+  typedef enum {
+    TELNET_DATA,
+    TELNET_IAC,
+    TELNET_OPTION,
+    TELNET_SB,
+    TELNET_SB_IAC
+  } telnet_state_t;
+
+  bool _send(const unsigned char *data, size_t length);
+  bool _com_port(unsigned char cmd, const unsigned char *value,
+                 size_t length);
+  size_t _parse(std::byte *data, size_t length);
+  ssize_t _recv(std::byte *data, size_t length);
+
+  int m_fd = -1;
+  std::string m_host;
+  std::string m_port;
+  bool m_rfc2217;
+  log_t m_log;
+  telnet_state_t m_state = TELNET_DATA;
+  unsigned char m_verb = 0;
+  std::vector<unsigned char> m_tx;
+  std::vector<std::byte> m_rx;
+};
+
+#endif /* INC_TCP */
@@ -0,0 +1,69 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_TRANSPORT
+#define INC_TRANSPORT
+
+#include "logger.hpp"
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct {
+  unsigned int baud = 115200;
+  unsigned int stop_bits = 2;
+  bool rtscts = false; // RTS/CTS hardware flow control
+} serif_line_t;
+
+// Modem control lines a fixture may wire to RESET or other pins
+#define SERIF_LINE_DTR 0x01
+#define SERIF_LINE_RTS 0x02
+
+// Byte stream underneath serif. Implementations hand out a pollable file
+// descriptor, serif does all framing, pipelining and deadline handling.
+class transport {
+public:
+  virtual ~transport() = default;
+  virtual bool open(const serif_line_t &line) = 0;
+  virtual int fd() = 0;
+  virtual ssize_t read(std::byte *data, size_t length) = 0;
+  virtual ssize_t writev(const struct iovec *iov, int count) = 0;
+  virtual size_t bytes_available() = 0;
+  virtual void drain() = 0;
+  virtual bool set_line(const serif_line_t &line) = 0;
+  virtual void set_low_latency(bool /*enable*/) {}
+  virtual size_t default_window() { return 1; }
+  // Asserts the SERIF_LINE_* bits in set and releases those in clear
+  virtual bool set_modem_lines(unsigned int /*set*/, unsigned int /*clear*/) {
+    return false;
+  }
+  // Device nodes come and go with hotplug, network links are taken to be
+  // there
+  virtual bool present() { return true; }
+  virtual bool
+  wait_present(std::chrono::steady_clock::time_point /*deadline*/) {
+    return true;
+  }
+};
+
+std::unique_ptr<transport> make_transport(const std::string &if_name,
+                                          log_t log);
+
+#endif /* INC_TRANSPORT */
@@ -0,0 +1,53 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_TTY
+#define INC_TTY
+
+#include "transport.hpp"
+#include <termios.h>
+
+class tty_transport : public transport {
+public:
+  tty_transport(const std::string &if_name, log_t log);
+  ~tty_transport();
+  bool open(const serif_line_t &line) override;
+  int fd() override;
+  ssize_t read(std::byte *data, size_t length) override;
+  ssize_t writev(const struct iovec *iov, int count) override;
+  size_t bytes_available() override;
+  void drain() override;
+  bool set_line(const serif_line_t &line) override;
+  void set_low_latency(bool enable) override;
+  bool set_modem_lines(unsigned int set, unsigned int clear) override;
+  bool present() override;
+  bool wait_present(std::chrono::steady_clock::time_point deadline) override;
+
+private:
+  bool _set_line(struct termios &tty, const serif_line_t &line);
+  void _apply_low_latency();
+  void _restore_low_latency();
+
+  int m_fd = -1;
+  std::string m_if_name;
+  log_t m_log;
+  int m_serial_flags = -1; // Original ASYNC_* flags if they were changed
+  std::string m_latency_timer;
+  std::string m_latency_timer_orig;
+};
+
+#endif /* INC_TTY */
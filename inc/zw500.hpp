@@ -0,0 +1,75 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INC_ZW500
+#define INC_ZW500
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include "logger.hpp"
+
+#define ZW500_FLASH_SIZE (64 * 2048)
+#define ZW500_SECTOR_SIZE 2048
+#define ZW500_NVR_SIZE 256
+#define ZW500_LOCK_BYTES 9
+#define ZW500_SIGNATURE_BYTES 7
+
+typedef struct {
+  std::chrono::microseconds program_time{5000};
+  std::chrono::microseconds erase_time{20000};
+  std::chrono::microseconds crc_time{100000};
+} zw500_timing_t;
+
+// In-memory model of a Z-Wave 500 series chip in programming mode
+class zw500 {
+public:
+  using clock = std::chrono::steady_clock;
+  using frame_t = std::array<std::byte, 4>;
+
+  zw500(const zw500_timing_t &timing, log_t log);
+  ~zw500() = default;
+  bool enabled();
+  void execute(const frame_t &cmd, frame_t &reply, clock::time_point now);
+  std::vector<std::byte> &flash();
+  std::vector<std::byte> &nvr();
+
+private:
+  std::byte _state_byte(clock::time_point now);
+  std::byte _read_next();
+  void _set_busy(clock::time_point now, std::chrono::microseconds duration);
+  bool _crc_ok();
+
+  zw500_timing_t m_timing;
+  log_t m_log;
+  std::vector<std::byte> m_flash;
+  std::vector<std::byte> m_sram;
+  std::vector<std::byte> m_nvr;
+  std::array<std::byte, ZW500_LOCK_BYTES> m_lockbits;
+  bool m_enabled = false;
+  bool m_read_sram = false;
+  size_t m_read_address = 0;
+  size_t m_write_address = 0;
+  clock::time_point m_busy_until;
+  clock::time_point m_crc_until;
+  bool m_crc_run = false;
+  bool m_crc_passed = false;
+};
+
+#endif /* INC_ZW500 */
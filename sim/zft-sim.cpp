@@ -0,0 +1,181 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "logger.hpp"
+#include "simulator.hpp"
+
+struct {
+  char *link = nullptr;
+  char *flash_if = nullptr;
+  char *flash_of = nullptr;
+  simulator_config_t config;
+  logger::log_level_t level = logger::LOG_INFO;
+} args;
+
+void print_help(const char *exec_name, log_t log) {
+  log->msg() << "Usage: " << exec_name
+             << " -L <link> -f <file> -o <file> -b <baud> -l <us> -p <us> "
+                "-e <us> -c <us> -E <rate> -s <seed> -v <level>"
+             << std::endl
+             << "        -L <link>      Symlink to the simulated port"
+             << std::endl
+             << "        -f <file>      Initial flash image" << std::endl
+             << "        -o <file>      Write flash to file on exit"
+             << std::endl
+             << "        -b <baud>      Reply pacing (default 115200, 0 = off)"
+             << std::endl
+             << "        -l <us>        Latency per command (default 0)"
+             << std::endl
+             << "        -p <us>        Sector/lockbit programming time "
+                "(default 5000)"
+             << std::endl
+             << "        -e <us>        Chip/sector erase time (default 20000)"
+             << std::endl
+             << "        -c <us>        CRC check time (default 100000)"
+             << std::endl
+             << "        -E <rate>      Bit error rate of replies (default 0)"
+             << std::endl
+             << "        -s <seed>      Seed for injected bit errors"
+             << std::endl
+             << "        -v <level>     Log level 0..4" << std::endl;
+}
+
+bool load_flash(log_t log, const char *file, std::vector<std::byte> &flash) {
+  std::ifstream fs(file, std::ios::binary);
+  if (!fs) {
+    log->error() << "Failed to open " << file << std::endl;
+    return false;
+  }
+  fs.read(reinterpret_cast<char *>(flash.data()),
+          static_cast<std::streamsize>(flash.size()));
+  return true;
+}
+
+bool dump_flash(log_t log, const char *file, std::vector<std::byte> &flash) {
+  std::ofstream fs(file, std::ios::binary);
+  if (!fs) {
+    log->error() << "Failed to open " << file << std::endl;
+    return false;
+  }
+  fs.write(reinterpret_cast<char *>(flash.data()),
+           static_cast<std::streamsize>(flash.size()));
+  return true;
+}
+
+int main(int argc, char **argv) {
+  log_t log(new logger(logger::LOG_ERROR));
+  int opt;
+  while ((opt = getopt(argc, argv, "L:f:o:b:l:p:e:c:E:s:v:h?")) != -1) {
+    switch (opt) {
+    case 'L':
+      args.link = optarg;
+      break;
+    case 'f':
+      args.flash_if = optarg;
+      break;
+    case 'o':
+      args.flash_of = optarg;
+      break;
+    case 'b':
+      args.config.baud = static_cast<unsigned int>(atoi(optarg));
+      break;
+    case 'l':
+      args.config.latency = std::chrono::microseconds(atoi(optarg));
+      break;
+    case 'p':
+      args.config.timing.program_time = std::chrono::microseconds(atoi(optarg));
+      break;
+    case 'e':
+      args.config.timing.erase_time = std::chrono::microseconds(atoi(optarg));
+      break;
+    case 'c':
+      args.config.timing.crc_time = std::chrono::microseconds(atoi(optarg));
+      break;
+    case 'E':
+      args.config.bit_error_rate = std::max(0.0, std::min(atof(optarg), 1.0));
+      break;
+    case 's':
+      args.config.seed = static_cast<unsigned int>(atoi(optarg));
+      break;
+    case 'v': {
+      const int min = static_cast<int>(logger::LOG_QUIET);
+      const int max = static_cast<int>(logger::LOG_DEBUG);
+      int level = std::max(min, std::min(atoi(optarg), max));
+      args.level = static_cast<logger::log_level_t>(level);
+      break;
+    }
+    case '?':
+    case 'h':
+      print_help(argv[0], log);
+      exit(0);
+      break;
+    default:
+      log->error() << "Unknown option: '" << char(optopt) << "'!" << std::endl;
+      print_help(argv[0], log);
+      exit(-1);
+      break;
+    }
+  }
+
+  log->set_log_level(args.level);
+
+  // Handle termination in main, the simulator thread inherits the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  simulator sim(args.config, log);
+  if (args.flash_if && !load_flash(log, args.flash_if, sim.device().flash())) {
+    return 1;
+  }
+  if (!sim.start()) {
+    return 1;
+  }
+  if (args.link) {
+    unlink(args.link);
+    if (symlink(sim.port().c_str(), args.link) != 0) {
+      log->error() << "Failed to link " << args.link << std::endl;
+      return 1;
+    }
+  }
+  log->msg() << (args.link ? args.link : sim.port().c_str()) << std::endl;
+
+  int sig;
+  sigwait(&signals, &sig);
+  sim.stop();
+
+  simulator_stats_t stats = sim.stats();
+  log->info() << "Simulated " << stats.commands << " commands, "
+              << stats.bit_errors << " bit errors injected" << std::endl;
+  if (args.link) {
+    unlink(args.link);
+  }
+  if (args.flash_of && !dump_flash(log, args.flash_of, sim.device().flash())) {
+    return 1;
+  }
+  return 0;
+}
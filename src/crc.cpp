@@ -17,15 +17,144 @@
 
 #include "crc.hpp"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_HAVE_PCLMUL
+#endif
+
 constexpr uint16_t crc16_start = 0x1D0F;
 constexpr uint16_t crc16_polynom = 0x1021;
 constexpr uint32_t crc32_start = 0xFFFFFFFF;
 constexpr uint32_t crc32_polynom = 0x04C11DB7;
 
+// Below this size the folding setup costs more than it saves
+constexpr size_t pclmul_min_size = 256;
+
+using crc16_engine = crc_engine<uint16_t, crc16_polynom>;
+using crc32_engine = crc_engine<uint32_t, crc32_polynom>;
+
+template <typename engine, typename T>
+T _crc_dispatch(unsigned char *data, size_t size, T crc_start,
+                T crc_polynom, crc::variant_t variant) {
+  switch (variant) {
+  case crc::CRC_BITWISE:
+    return _crc_generic(data, size, crc_start, crc_polynom);
+  case crc::CRC_TABLE:
+    return engine::bytewise(crc_start, data, size);
+  case crc::CRC_SLICE8:
+    return engine::slice8(crc_start, data, size);
+  case crc::CRC_PCLMUL:
+    return engine::pclmul(crc_start, data, size);
+  case crc::CRC_AUTO:
+  default:
+    return (size >= pclmul_min_size) ? engine::pclmul(crc_start, data, size)
+                                     : engine::slice8(crc_start, data, size);
+  }
+}
+
 uint16_t crc::crc16(unsigned char *data, size_t size) {
-  return _crc_generic(data, size, crc16_start, crc16_polynom);
+  return crc16(data, size, CRC_AUTO);
 }
 
 uint32_t crc::crc32(unsigned char *data, size_t size) {
-  return _crc_generic(data, size, crc32_start, crc32_polynom);
-}
\ No newline at end of file
+  return crc32(data, size, CRC_AUTO);
+}
+
+uint16_t crc::crc16(unsigned char *data, size_t size, variant_t variant) {
+  return _crc_dispatch<crc16_engine>(data, size, crc16_start, crc16_polynom,
+                                     variant);
+}
+
+uint32_t crc::crc32(unsigned char *data, size_t size, variant_t variant) {
+  return _crc_dispatch<crc32_engine>(data, size, crc32_start, crc32_polynom,
+                                     variant);
+}
+
+const char *crc::variant_name(variant_t variant) {
+  switch (variant) {
+  case CRC_BITWISE:
+    return "bitwise";
+  case CRC_TABLE:
+    return "table";
+  case CRC_SLICE8:
+    return "slice8";
+  case CRC_PCLMUL:
+    return "pclmul";
+  case CRC_AUTO:
+  default:
+    return "auto";
+  }
+}
+
+#ifdef CRC_HAVE_PCLMUL
+bool crc::has_pclmul() {
+  static const bool supported =
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+  return supported;
+}
+
+__attribute__((target("pclmul,ssse3"))) static inline __m128i
+_fold(__m128i lane, __m128i constants, __m128i next) {
+  __m128i high = _mm_clmulepi64_si128(lane, constants, 0x11);
+  __m128i low = _mm_clmulepi64_si128(lane, constants, 0x00);
+  return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+// Byte swapped loads put the first byte into the top bits, matching the MSB
+// first polynomial order
+__attribute__((target("pclmul,ssse3"))) static inline __m128i
+_load(const unsigned char *data, size_t block) {
+  const __m128i swap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i value =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + block * 16));
+  return _mm_shuffle_epi8(value, swap);
+}
+
+__attribute__((target("pclmul,ssse3"))) static inline __m128i
+_pair(const uint64_t *constants, size_t index) {
+  return _mm_set_epi64x(static_cast<long long>(constants[index * 2]),
+                        static_cast<long long>(constants[index * 2 + 1]));
+}
+
+__attribute__((target("pclmul,ssse3"))) void
+_crc_fold_pclmul(const unsigned char *data, size_t blocks, uint64_t init,
+                 const uint64_t *constants, unsigned char *remainder) {
+  const __m128i k512 = _pair(constants, 0);
+  const __m128i k384 = _pair(constants, 1);
+  const __m128i k256 = _pair(constants, 2);
+  const __m128i k128 = _pair(constants, 3);
+
+  // Four independent lanes keep the multiplier pipeline busy
+  __m128i x0 = _mm_xor_si128(_load(data, 0),
+                             _mm_set_epi64x(static_cast<long long>(init), 0));
+  __m128i x1 = _load(data, 1);
+  __m128i x2 = _load(data, 2);
+  __m128i x3 = _load(data, 3);
+  size_t block = 4;
+  for (; block + 4 <= blocks; block += 4) {
+    x0 = _fold(x0, k512, _load(data, block));
+    x1 = _fold(x1, k512, _load(data, block + 1));
+    x2 = _fold(x2, k512, _load(data, block + 2));
+    x3 = _fold(x3, k512, _load(data, block + 3));
+  }
+
+  __m128i x = _fold(x0, k384, _mm_setzero_si128());
+  x = _mm_xor_si128(x, _fold(x1, k256, _mm_setzero_si128()));
+  x = _mm_xor_si128(x, _fold(x2, k128, x3));
+  for (; block < blocks; block++) {
+    x = _fold(x, k128, _load(data, block));
+  }
+
+  // Back to memory order, the caller finishes with the table
+  const __m128i swap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(remainder),
+                   _mm_shuffle_epi8(x, swap));
+}
+#else
+bool crc::has_pclmul() { return false; }
+
+void _crc_fold_pclmul(const unsigned char *data, size_t blocks, uint64_t init,
+                      const uint64_t *constants, unsigned char *remainder) {}
+#endif
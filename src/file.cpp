@@ -0,0 +1,62 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include "file.hpp"
+
+bool file::load(log_t log, const char *file,
+                std::vector<std::byte> &out_vector) {
+  std::ifstream fs;
+  fs.open(file, std::ios::binary);
+  if (!fs) {
+    log->error() << "Failed to open " << file << std::endl;
+    return false;
+  }
+
+  fs.seekg(0, fs.end);
+  int length = fs.tellg();
+  fs.seekg(0, fs.beg);
+
+  std::vector<char> temp_file_buffer;
+
+  temp_file_buffer.resize(length);
+  out_vector.reserve(length);
+  fs.read(temp_file_buffer.data(), length);
+
+  std::transform(temp_file_buffer.begin(), temp_file_buffer.end(),
+                 std::back_insert_iterator(out_vector),
+                 [](char in) { return static_cast<std::byte>(in); });
+  return true;
+}
+
+bool file::dump(log_t log, const char *file, std::vector<std::byte> &buffer) {
+  std::ofstream fs;
+  fs.open(file, std::ios::binary);
+  if (!fs) {
+    log->error() << "Failed to open " << file << std::endl;
+    return false;
+  }
+  for (size_t i = 0; i < buffer.size(); i++) {
+    char value = static_cast<char>(buffer[i]);
+    fs.write(&value, 1);
+  }
+  fs.close();
+  return true;
+}
@@ -19,7 +19,11 @@
 #include <array>
 #include <bitset>
 #include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <iostream>
+#include <numeric>
+#include <random>
 #include <thread>
 #include <vector>
 
@@ -28,75 +32,272 @@
 #include "crc.hpp"
 #include "flasher.hpp"
 #include "nvr.hpp"
+#include "sector.hpp"
 
 constexpr unsigned int polling_timeout = 100;
-constexpr unsigned int retry_count = 50;
 constexpr unsigned int connect_count = 4;
-constexpr size_t sector_size = 2048;
-constexpr size_t max_sectors = 64;
+// USB-serial adapters hold received bytes for up to 16 ms
+constexpr std::chrono::milliseconds enable_reply{20};
+constexpr size_t sector_size = FLASH_SECTOR_SIZE;
+constexpr size_t max_sectors = FLASH_SECTORS;
 constexpr size_t signature_bytes = 7;
+constexpr size_t round_trip_samples = 16;
+constexpr size_t rate_samples = 64;
+constexpr size_t read_chunk_sectors = 32;
+constexpr size_t identical_tail_sectors = 2;
+constexpr unsigned int command_retries = 3;
+constexpr unsigned int sector_retries = 3;
+constexpr size_t nvr_bytes = NVR_STOP - NVR_START + 1;
+
+typedef struct {
+  const char *name;
+  std::chrono::microseconds expected; // Typical time to completion
+  std::chrono::milliseconds limit;    // Give up after
+} poll_hint_t;
+
+// Indexed by poll_op_t, the limits are those of the former fixed 100 ms
+// polling loops
+constexpr poll_hint_t poll_hints[POLL_OPS] = {
+    {"sector program", std::chrono::microseconds(5000),
+     std::chrono::milliseconds(5000)},
+    {"sector erase", std::chrono::microseconds(20000),
+     std::chrono::milliseconds(5000)},
+    {"chip erase", std::chrono::microseconds(20000),
+     std::chrono::milliseconds(1000)},
+    {"CRC check", std::chrono::microseconds(100000),
+     std::chrono::milliseconds(5000)},
+    {"lockbits", std::chrono::microseconds(5000),
+     std::chrono::milliseconds(1000)},
+    {"idle", std::chrono::microseconds(0), std::chrono::milliseconds(1000)}};
+constexpr std::chrono::microseconds min_poll_interval{100};
+constexpr std::chrono::microseconds max_poll_interval{polling_timeout * 1000};
 
 flasher::flasher(const char *serif, log_t log)
-    : m_serif(serif, log), m_log(log) {}
+    : m_serif(serif, log), m_log(log), m_nvr_cache(log) {}
+
+void flasher::set_window(size_t depth) { m_serif.set_window(depth); }
+
+void flasher::set_fail_fast(bool enable) { m_fail_fast = enable; }
+
+void flasher::set_phase_budget(std::chrono::milliseconds budget) {
+  m_budget = budget;
+}
+
+void flasher::begin_phase() { m_serif.begin_phase(m_budget); }
+
+void flasher::set_nvr_cache(const std::string &dir) { m_nvr_cache.open(dir); }
+
+void flasher::set_reset_lines(const std::vector<serif_line_step_t> &enter,
+                              const std::vector<serif_line_step_t> &release) {
+  m_enter_lines = enter;
+  m_release_lines = release;
+}
+
+void flasher::set_sector_hook(std::function<bool(size_t)> hook) {
+  m_sector_hook = hook;
+}
+
+void flasher::set_low_latency(bool enable) { m_low_latency = enable; }
+
+bool flasher::set_line(const serif_line_t &line) {
+  return m_serif.set_line(line);
+}
+
+bool flasher::record(const std::string &file) {
+  return m_serif.record(file);
+}
+
+bool flasher::replay(const std::string &file, bool realtime) {
+  return m_serif.replay(file, realtime);
+}
+
+bool flasher::probe(unsigned char timeout, std::vector<unsigned int> bauds) {
+  std::sort(bauds.begin(), bauds.end(), std::greater<unsigned int>());
+  for (unsigned int baud : bauds) {
+    serif_line_t line = m_serif.line();
+    line.baud = baud;
+    m_log->info() << "Probing " << std::dec << baud << " baud" << std::endl;
+    if (!m_serif.set_line(line) || !connect(timeout)) {
+      continue;
+    }
+    m_log->msg() << "Using " << std::dec << baud << " baud, "
+                 << line.stop_bits << " stop bits"
+                 << (line.rtscts ? ", RTS/CTS" : "") << ": "
+                 << _bytes_per_second() << " bytes/s" << std::endl;
+    return true;
+  }
+  m_log->error() << "No probed baud rate answered" << std::endl;
+  return false;
+}
 
 bool flasher::_write_cmd(std::string out_msg, buffer &buf) {
   m_log->debug() << "Flasher: " << out_msg << std::endl;
-  return m_serif.write_cmd(buf);
+  return m_serif.queue_write_cmd(buf);
 }
 
 bool flasher::_read_cmd(std::string out_msg, buffer &buf) {
   m_log->debug() << "Flasher: " << out_msg << std::endl;
-  return m_serif.read_cmd(buf);
+  // Queued writes are not repeated here, they fail the caller
+  if (!m_serif.flush()) {
+    return false;
+  }
+  // Single reads only address or poll, sending them again is harmless
+  buffer cmd = buf;
+  return _retry(out_msg, [this, &cmd, &buf]() {
+    buf = cmd;
+    return m_serif.read_cmd(buf);
+  });
 }
 
-bool flasher::_write_sector(unsigned int sector, std::byte *in_buf,
-                            unsigned int length) {
-  unsigned int begin = 0;
-  unsigned int end = length;
-
-  while (begin < length && in_buf[begin] == static_cast<std::byte>(0xFF)) {
-    begin++;
+bool flasher::_retry(const std::string &what, std::function<bool()> op) {
+  for (unsigned int attempt = 0;; attempt++) {
+    if (op()) {
+      return true;
+    }
+    if (attempt == command_retries) {
+      return false;
+    }
+    m_log->warn() << what << " failed, retrying" << std::endl;
+    m_retries++;
+    if (!_resync()) {
+      return false;
+    }
   }
+}
 
-  if (begin == length) {
-    return true;
-  }
+bool flasher::_resync() {
+  m_resyncs++;
+  return m_serif.resync() && _enable();
+}
+
+bool flasher::_queue_read_cmd(std::string out_msg, buffer &buf,
+                              std::function<void(buffer &)> on_reply) {
+  m_log->debug() << "Flasher: " << out_msg << std::endl;
+  return m_serif.queue_read_cmd(buf, on_reply);
+}
+
+const serif_stats_t &flasher::stats() { return m_serif.stats(); }
 
-  while (end > 0 && in_buf[end - 1] == static_cast<std::byte>(0xFF)) {
-    end--;
+void flasher::report_stats() {
+  const serif_stats_t &stats = m_serif.stats();
+  if (stats.commands == 0) {
+    return;
+  }
+  if (m_retries || m_sector_retries || stats.timeouts) {
+    m_log->msg() << "Recovery: " << std::dec << m_retries
+                 << " command retries, " << m_sector_retries
+                 << " sector retries, " << m_resyncs << " line resyncs, "
+                 << stats.timeouts << " timeouts" << std::endl;
+  }
+  std::chrono::steady_clock::duration wait{};
+  size_t polls = 0;
+  for (size_t op = 0; op < POLL_OPS; op++) {
+    wait += m_wait[op];
+    polls += m_polls[op];
   }
+  if (polls) {
+    using ms = std::chrono::duration<double, std::milli>;
+    m_log->msg() << "Device wait: " << std::dec
+                 << std::chrono::duration<double>(wait).count() << " s in "
+                 << polls << " state polls" << std::endl;
+    for (size_t op = 0; op < POLL_OPS; op++) {
+      if (m_waits[op]) {
+        m_log->info() << "Wait " << poll_hints[op].name << ": "
+                      << m_waits[op] << " times, avg "
+                      << ms(m_wait[op]).count() / m_waits[op] << " ms, "
+                      << static_cast<double>(m_polls[op]) / m_waits[op]
+                      << " polls" << std::endl;
+      }
+    }
+  }
+  using us = std::chrono::duration<double, std::micro>;
+  m_log->info() << "Serial: " << std::dec << stats.commands
+                << " commands, latency avg "
+                << us(stats.total).count() / stats.commands << " us, min "
+                << us(stats.min).count() << " us, max "
+                << us(stats.max).count() << " us" << std::endl;
+  m_log->info() << "Serial: " << stats.tx_bytes << " bytes sent in "
+                << stats.tx_writes << " writes" << std::endl;
+  if (stats.resyncs) {
+    m_log->info() << "Serial: " << stats.resyncs << " resyncs, "
+                  << stats.dropped_bytes << " bytes dropped" << std::endl;
+  }
+}
 
-  unsigned int actual_length = end - begin;
-  unsigned int offset = (actual_length - 1) % 3;
+void flasher::_report_throughput(std::string phase,
+                                 std::chrono::steady_clock::time_point start,
+                                 size_t commands, size_t bytes) {
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  if (elapsed <= 0) {
+    return;
+  }
+  m_log->info() << phase << ": " << std::dec << bytes << " bytes, "
+                << commands << " commands in " << elapsed << " s ("
+                << static_cast<size_t>(commands / elapsed) << " cmd/s, "
+                << static_cast<size_t>(bytes / elapsed) << " bytes/s)"
+                << std::endl;
+}
 
-  for (int i = 0; i < offset; i++) {
-    if (!_write_single_byte(begin, in_buf[begin])) {
+bool flasher::_write_sector_retry(unsigned int sector, bool erase) {
+  std::byte *data = &m_file_buffer[sector * sector_size];
+  for (unsigned int attempt = 0;; attempt++) {
+    // A failed load may have left stray bytes anywhere in SRAM, so repeats
+    // load the whole sector. They may also have been programmed already and
+    // programming cannot set bits back to 1, so repeats erase first even
+    // where the chip erase covered the first attempt.
+    if ((!(erase || attempt > 0) || _erase_sector(sector)) &&
+        _write_sector(sector, data, sector_size, attempt > 0)) {
+      return true;
+    }
+    if (attempt == sector_retries) {
       return false;
     }
-    if (!_write_flash(sector, retry_count)) {
+    m_log->warn() << "Write sector " << std::dec << sector
+                  << " failed, retrying" << std::endl;
+    m_sector_retries++;
+    if (!_resync()) {
       return false;
     }
-    begin++;
   }
+}
 
-  if (!_write_single_byte(begin, in_buf[begin])) {
-    return false;
+bool flasher::_write_sector(unsigned int sector, std::byte *in_buf,
+                            unsigned int length, bool full) {
+  if (full) {
+    sector::plan_full(in_buf, length, m_steps);
+  } else {
+    sector::plan(in_buf, length, m_steps);
+  }
+  size_t linear = sector::linear_commands(in_buf, length);
+  m_log->debug() << "Sector " << std::dec << sector << ": " << m_steps.size()
+                 << " commands, " << linear << " without skipping holes"
+                 << std::endl;
+  m_plan_commands += m_steps.size();
+  m_plan_linear += linear;
+  if (!m_steps.empty() && (m_written.empty() || m_written.back() != sector)) {
+    m_written.push_back(sector);
   }
-  begin++;
 
-  while (begin < end) {
-    std::byte b0 = in_buf[begin++];
-    std::byte b1 = in_buf[begin++];
-    std::byte b2 = in_buf[begin++];
-    if (!_write_byte_block(b0, b1, b2)) {
+  for (const sector_step_t &step : m_steps) {
+    bool ok = false;
+    switch (step.op) {
+    case SECTOR_WRITE_BYTE:
+      ok = _write_single_byte(step.address, step.data[0]);
+      break;
+    case SECTOR_WRITE_BLOCK:
+      ok = _write_byte_block(step.data[0], step.data[1], step.data[2]);
+      break;
+    case SECTOR_PROGRAM:
+      ok = _write_flash(sector);
+      break;
+    }
+    if (!ok) {
       return false;
     }
   }
 
-  if (!_write_flash(sector, retry_count)) {
-    return false;
-  }
-
   return true;
 }
 
@@ -117,13 +318,22 @@ bool flasher::_write_byte_block(std::byte byte1, std::byte byte2,
   return _write_cmd("Write byte block to SRAM", cmd);
 }
 
-bool flasher::_write_flash(unsigned int sector, unsigned int retry) {
+bool flasher::_write_flash(unsigned int sector) {
   buffer write(CMD_WRITE_FLASH_SECTOR);
   write[1] = static_cast<std::byte>(sector & 0xFF);
   if (!_write_cmd("Write flash", write)) {
     return false;
   }
-  return _check_state(retry, CMD_FLASH_STATE_BIT, false);
+  return _check_state(POLL_PROGRAM, CMD_FLASH_STATE_BIT, false);
+}
+
+bool flasher::_erase_sector(unsigned int sector) {
+  buffer erase(CMD_ERASE_SECTOR);
+  erase[1] = static_cast<std::byte>(sector & 0xFF);
+  if (!_write_cmd("Erase sector", erase)) {
+    return false;
+  }
+  return _check_state(POLL_ERASE, CMD_FLASH_STATE_BIT, false);
 }
 
 bool flasher::_generate_crc32() {
@@ -134,9 +344,9 @@ bool flasher::_generate_crc32() {
 
   m_log->info() << "Calculated flash CRC: " << crc32 << std::endl;
 
-  m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0xFF000000) << 24));
-  m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0x00FF0000) << 16));
-  m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0x0000FF00) << 8));
+  m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0xFF000000) >> 24));
+  m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0x00FF0000) >> 16));
+  m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0x0000FF00) >> 8));
   m_file_buffer.push_back(static_cast<std::byte>((crc32 & 0x000000FF)));
 
   return true;
@@ -151,21 +361,70 @@ bool flasher::_get_state_byte(std::byte &state_byte) {
   return false;
 }
 
-bool flasher::_check_state(unsigned int retry, std::byte mask, bool state) {
-  bool done = false;
-  while (retry && !done) {
+bool flasher::_check_state(poll_op_t op, std::byte mask, bool state) {
+  // Poll tightly while the operation is expected to run, at most a quarter
+  // of its expected time apart, then back off exponentially
+  const poll_hint_t &hint = poll_hints[op];
+  auto start = std::chrono::steady_clock::now();
+  auto interval = std::max(hint.expected / 16, min_poll_interval);
+  for (;;) {
     std::byte state_byte;
     if (!_get_state_byte(state_byte)) {
       return false;
     }
-    done = (((state_byte & mask) == mask));
+    m_polls[op]++;
+    bool done = (((state_byte & mask) == mask));
     done = (done == state);
-    if (!done) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(polling_timeout));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (done) {
+      m_wait[op] += elapsed;
+      m_waits[op]++;
+      return true;
+    }
+    if (elapsed >= hint.limit) {
+      m_log->error() << "Timeout waiting for " << hint.name << " after "
+                     << std::dec
+                     << std::chrono::duration<double>(elapsed).count()
+                     << " s" << std::endl;
+      return false;
     }
-    retry--;
+    std::this_thread::sleep_for(interval);
+    auto cap = elapsed < hint.expected ? std::max(hint.expected / 4,
+                                                  min_poll_interval)
+                                       : max_poll_interval;
+    interval = std::min(interval * 2, cap);
+  }
+}
+
+double flasher::_round_trip_us() {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < round_trip_samples; i++) {
+    std::byte state_byte;
+    if (!_get_state_byte(state_byte)) {
+      return 0;
+    }
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / round_trip_samples;
+}
+
+size_t flasher::_bytes_per_second() {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rate_samples; i++) {
+    buffer cmd(CMD_READ_SIGNATURE);
+    cmd[1] = static_cast<std::byte>(i % signature_bytes);
+    if (!_queue_read_cmd("Measure rate", cmd, [](buffer &) {})) {
+      return 0;
+    }
+  }
+  if (!m_serif.flush()) {
+    return 0;
   }
-  return done;
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  // Every command moves four bytes in each direction
+  return static_cast<size_t>(rate_samples * 8 / elapsed.count());
 }
 
 bool flasher::_read_signature() {
@@ -180,197 +439,851 @@ bool flasher::_read_signature() {
     }
     signature[i] = static_cast<int>(read_signature[3]);
   }
+  m_signature.clear();
+  for (i = 0; i < signature_bytes; i++) {
+    m_signature.push_back(static_cast<std::byte>(signature[i]));
+  }
   m_log->msg() << "Signature: ";
   for (i = 0; i < signature_bytes; i++) {
     m_log->msg() << "0x" << std::hex << signature[i] << " ";
   }
-  std::cout << std::endl;
-  return _check_state(10, CMD_FLASH_STATE_BIT, false);
+  m_log->msg() << std::endl;
+  return _check_state(POLL_IDLE, CMD_FLASH_STATE_BIT, false);
 }
 
 bool flasher::connect(unsigned char timeout) {
-  buffer cmd(CMD_ENABLE_INTERFACE);
-  int cnt = 0;
-
   if (!m_serif.open(timeout)) {
     m_log->error() << "Failed to open serial device" << std::endl;
     return false;
   }
+  // Each attempt resets the chip into programming mode afresh, without line
+  // control RESET is left to whoever holds it
+  if (!m_serif.run_lines(m_enter_lines)) {
+    m_log->error() << "Programming mode not entered by modem lines"
+                   << std::endl;
+    return false;
+  }
+  if (!_enable() || !_read_signature()) {
+    return false;
+  }
+  if (m_low_latency) {
+    double before = _round_trip_us();
+    m_serif.set_low_latency(true);
+    m_log->info() << "Round trip " << before << " us before, "
+                  << _round_trip_us()
+                  << " us after applying low latency profile" << std::endl;
+  }
+  return true;
+}
+
+bool flasher::_enable() {
+  // The reply is awaited rather than slept for. A miss shifts the framing
+  // of the chip by one byte, so the four attempts cover every offset, and
+  // waits for the line to calm down so a late reply is not taken for the
+  // next one.
+  buffer cmd(CMD_ENABLE_INTERFACE);
+  unsigned int cnt = 0;
 
   while (cnt < connect_count) {
     m_log->info() << "Trying to connect" << std::endl;
     m_serif.write_raw(cmd.data(), 4);
-    std::this_thread::sleep_for(std::chrono::milliseconds(2));
-    size_t residual = m_serif.bytes_available();
+    size_t residual = m_serif.wait_bytes(4, enable_reply);
     if (residual == 2 || residual == 4) {
       size_t o = residual - 2;
       std::vector<std::byte> recv;
       recv.resize(residual);
       if (m_serif.read_raw(recv.data(), residual)) {
         if (recv[o] == cmd[2] && recv[o + 1] == cmd[3]) {
-          return _read_signature();
+          return true;
         }
       }
     }
     std::byte dummy{0};
     m_serif.write_raw(&dummy, 1);
-    std::this_thread::sleep_for(std::chrono::milliseconds(polling_timeout));
+    m_serif.resync();
     cnt++;
   }
   return false;
 }
 
-bool flasher::write_flash(std::vector<std::byte> &flash, size_t sector_offset) {
-  std::transform(flash.begin(), flash.end(),
-                 std::back_insert_iterator(m_file_buffer),
-                 [](std::byte in) { return in; });
+bool flasher::wait_for_device(std::chrono::steady_clock::time_point deadline) {
+  return m_serif.wait_present(deadline);
+}
 
+void flasher::_prepare_image(std::vector<std::byte> &flash) {
+  m_file_buffer.assign(flash.begin(), flash.end());
   m_file_buffer.resize(max_sectors * sector_size - 4,
                        static_cast<std::byte>(0xFF));
   _generate_crc32();
+}
 
-  m_log->info() << "Writing " << std::dec << m_file_buffer.size()
-                << " bytes in " << max_sectors << " sectors" << std::endl;
-  for (size_t sector = sector_offset; sector < max_sectors; sector++) {
+bool flasher::_write_sectors(const std::vector<size_t> &sectors, bool erase) {
+  m_log->info() << "Writing " << std::dec << sectors.size() * sector_size
+                << " bytes in " << sectors.size() << " sectors" << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  size_t commands = m_serif.stats().commands;
+  m_plan_commands = m_plan_linear = 0;
+  m_written.clear();
+  for (size_t sector : sectors) {
     m_log->info() << "Write sector " << sector << std::endl;
-    if (!_write_sector(sector, &(m_file_buffer.data()[sector * sector_size]),
-                       sector_size)) {
+    if (!_write_sector_retry(sector, erase)) {
+      return false;
+    }
+    if (m_sector_hook && !m_sector_hook(sector)) {
+      m_log->error() << "Recording sector " << sector << " failed"
+                     << std::endl;
+      return false;
+    }
+  }
+  _report_throughput("Write flash", start, m_serif.stats().commands - commands,
+                     sectors.size() * sector_size);
+  _report_plan(sectors.size());
+  return true;
+}
+
+bool flasher::write_flash(std::vector<std::byte> &flash, size_t sector_offset,
+                          size_t sector_count) {
+  _prepare_image(flash);
+
+  // Only the whole chip is written after a chip erase, a region erases its
+  // own sectors. The last sector holds the CRC32 of the image and is always
+  // written along.
+  size_t end = std::min(sector_offset + sector_count, max_sectors);
+  bool region = sector_offset > 0 || end < max_sectors;
+  m_range.clear();
+  for (size_t sector = sector_offset; sector < end; sector++) {
+    m_range.push_back(sector);
+  }
+  if (end < max_sectors) {
+    m_range.push_back(max_sectors - 1);
+  }
+
+  if (!_write_sectors(m_range, region)) {
+    return false;
+  }
+  if (!check_crc()) {
+    if (region) {
+      m_log->error() << "CRC check failed, the flash outside the region "
+                        "does not match the image"
+                     << std::endl;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool flasher::resume_flash(std::vector<std::byte> &flash,
+                           size_t sector_offset) {
+  _prepare_image(flash);
+
+  // The job covers the whole chip. The sector that was being programmed
+  // when it broke off may hold part of its data, the ones after it are
+  // still erased.
+  m_range.clear();
+  std::vector<size_t> sectors;
+  for (size_t sector = 0; sector < max_sectors; sector++) {
+    m_range.push_back(sector);
+    if (sector >= sector_offset) {
+      sectors.push_back(sector);
+    }
+  }
+  m_log->msg() << "Resuming write at sector " << std::dec << sector_offset
+               << ", " << sector_offset << " of " << max_sectors
+               << " sectors skipped" << std::endl;
+  if (!sectors.empty() && !_erase_sector(sectors.front())) {
+    return false;
+  }
+  return _write_sectors(sectors, false);
+}
+
+void flasher::_report_plan(size_t sectors) {
+  if (sectors == 0) {
+    return;
+  }
+  m_log->info() << "Sector plan: " << std::dec << m_plan_commands
+                << " commands, " << m_plan_linear
+                << " without skipping holes, "
+                << static_cast<double>(m_plan_commands) / sectors << " vs "
+                << static_cast<double>(m_plan_linear) / sectors
+                << " per sector" << std::endl;
+}
+
+bool flasher::_read_sectors(size_t first, size_t count,
+                            std::vector<std::byte> &out) {
+  // One READ_FLASH for the first byte, then three bytes per CONT_READ. The
+  // last reply may run up to two bytes past the range, those are dropped.
+  size_t length = count * sector_size;
+  size_t base = out.size();
+  out.resize(base + length + 2);
+
+  buffer read_flash(CMD_READ_FLASH);
+  read_flash[1] = static_cast<std::byte>(first);
+  if (!_read_cmd("Read flash", read_flash)) {
+    m_log->error() << "Failed " << read_flash << std::endl;
+    return false;
+  }
+  out[base] = read_flash[3];
+  std::byte *cont = &out[base + 1];
+  for (size_t i = 0; i < (length + 1) / 3; i++, cont += 3) {
+    buffer read_cont(CMD_CONT_READ_SRAM);
+    if (!_queue_read_cmd("Read cont", read_cont, [cont](buffer &reply) {
+          cont[0] = reply[1];
+          cont[1] = reply[2];
+          cont[2] = reply[3];
+        })) {
+      m_log->error() << "Failed " << read_cont << std::endl;
+      return false;
+    }
+  }
+  if (!m_serif.flush()) {
+    return false;
+  }
+  out.resize(base + length);
+  return true;
+}
+
+bool flasher::write_flash_diff(std::vector<std::byte> &flash,
+                               std::vector<std::byte> &baseline) {
+  std::vector<std::byte> old;
+  if (baseline.empty()) {
+    m_log->info() << "Reading flash as baseline" << std::endl;
+    if (!read_flash(old, 0, max_sectors)) {
       return false;
     }
+  } else {
+    _prepare_image(baseline);
+    old.swap(m_file_buffer);
+  }
+  _prepare_image(flash);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t commands = m_serif.stats().commands;
+  size_t touched = 0;
+  size_t planned_all = 0;
+  size_t planned_touched = 0;
+  m_range.clear();
+  m_plan_commands = m_plan_linear = 0;
+  m_written.clear();
+  for (size_t sector = 0; sector < max_sectors; sector++) {
+    m_range.push_back(sector);
+    std::byte *data = &m_file_buffer[sector * sector_size];
+    sector::plan(data, sector_size, m_steps);
+    planned_all += m_steps.size();
+    if (std::equal(data, data + sector_size, &old[sector * sector_size])) {
+      continue;
+    }
+    m_log->info() << "Write sector " << std::dec << sector << std::endl;
+    planned_touched += m_steps.size();
+    touched++;
+    if (!_write_sector_retry(sector, true)) {
+      return false;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  _report_throughput("Write flash", start, m_serif.stats().commands - commands,
+                     touched * sector_size);
+  _report_plan(touched);
+
+  if (touched == 0) {
+    m_log->msg() << "Differential flash: no sectors differ" << std::endl;
+  } else {
+    // Scale by the commands a full write would have planned
+    double full = planned_touched
+                      ? elapsed.count() * planned_all / planned_touched
+                      : elapsed.count();
+    m_log->msg() << "Differential flash: " << std::dec << touched << " of "
+                 << max_sectors << " sectors touched in " << elapsed.count()
+                 << " s, full flash estimated " << full << " s, saved "
+                 << full - elapsed.count() << " s" << std::endl;
+  }
+
+  if (!check_crc()) {
+    m_log->error() << "CRC check failed, the baseline does not match the "
+                      "device. Flash without differential mode."
+                   << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool flasher::read_flash(std::vector<std::byte> &flash, size_t sector_offset,
+                         size_t sector_count) {
+  size_t sector = sector_offset;
+  size_t end = std::min(sector_offset + sector_count, max_sectors);
+  auto start = std::chrono::steady_clock::now();
+  size_t commands = m_serif.stats().commands;
+  flash.reserve(flash.size() + (end - sector_offset) * sector_size);
+  while (sector < end) {
+    size_t count = std::min(read_chunk_sectors, end - sector);
+    if (!_read_sectors(sector, count, flash)) {
+      return false;
+    }
+    sector += count;
+  }
+  _report_throughput("Read flash", start, m_serif.stats().commands - commands,
+                     (end - sector_offset) * sector_size);
+
+  return true;
+}
+
+bool flasher::check_identical(std::vector<std::byte> &flash,
+                              bool &identical) {
+  identical = false;
+  _prepare_image(flash);
+  auto start = std::chrono::steady_clock::now();
+
+  // The stored CRC32 sits at the very end, compare the tail directly
+  std::vector<std::byte> tail;
+  if (!_read_sectors(max_sectors - identical_tail_sectors,
+                     identical_tail_sectors, tail)) {
+    return false;
   }
+  if (!std::equal(tail.begin(), tail.end(),
+                  m_file_buffer.end() - tail.size())) {
+    m_log->info() << "Flash differs from image, flashing required"
+                  << std::endl;
+    return true;
+  }
+
+  // With the same CRC32 in place the chip checks everything in front of it
+  identical = check_crc();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  m_log->info() << "Identity check took " << elapsed.count() << " s"
+                << std::endl;
+  return true;
+}
 
-  return check_crc();
+void flasher::_check(size_t position, std::byte data) {
+  std::byte expected = m_file_buffer[position];
+  if (expected == data) {
+    return;
+  }
+  if (!m_mismatches.empty() && m_mismatches.back().second == position) {
+    m_mismatches.back().second++;
+    return;
+  }
+  if (m_mismatches.empty()) {
+    m_mismatch_data = data;
+  }
+  m_mismatches.push_back({position, position + 1});
 }
 
-bool flasher::read_flash(std::vector<std::byte> &flash, size_t sector_offset) {
-  size_t sector = 0;
-  size_t bytes_read = 0;
-  auto const append_byte = [](std::vector<std::byte> &flash,
-                              size_t sector_offset, size_t cnt,
-                              std::byte byte) {
-    if ((cnt / sector_size) >= sector_offset) {
-      flash.push_back(byte);
+bool flasher::_verify_range(size_t first, size_t count) {
+  // Same command sequence as _read_sectors, but each reply is compared as
+  // it arrives. Fail fast stops queueing, only the window still drains. The
+  // bytes the last reply reads past the range are real flash content and
+  // are compared as well, the capture stays small enough for std::function
+  // to not allocate.
+  size_t position = first * sector_size;
+  size_t end = position + count * sector_size;
+
+  buffer read_flash(CMD_READ_FLASH);
+  read_flash[1] = static_cast<std::byte>(first);
+  if (!_read_cmd("Read flash", read_flash)) {
+    m_log->error() << "Failed " << read_flash << std::endl;
+    return false;
+  }
+  _check(position++, read_flash[3]);
+  for (; position < end; position += 3) {
+    if (m_fail_fast && !m_mismatches.empty()) {
+      break;
     }
-  };
-  while (sector < max_sectors) {
-    buffer read_flash(CMD_READ_FLASH);
-    read_flash[1] = static_cast<std::byte>(sector);
-    if (!_read_cmd("Read flash", read_flash)) {
-      m_log->error() << "Failed " << read_flash << std::endl;
+    buffer read_cont(CMD_CONT_READ_SRAM);
+    if (!_queue_read_cmd("Read cont", read_cont,
+                         [this, position](buffer &reply) {
+                           for (size_t i = 0; i < 3; i++) {
+                             if (position + i < m_file_buffer.size()) {
+                               _check(position + i, reply[i + 1]);
+                             }
+                           }
+                         })) {
+      m_log->error() << "Failed " << read_cont << std::endl;
       return false;
     }
-    bytes_read++;
-    append_byte(flash, sector_offset, bytes_read, read_flash[3]);
-    for (size_t i = 0; i < (((sector_size * 32) - 1) / 3); i++) {
-      buffer read_cont(CMD_CONT_READ_SRAM);
-      if (!_read_cmd("Read cont", read_cont)) {
-        m_log->error() << "Failed " << read_cont << std::endl;
+  }
+  return m_serif.flush();
+}
+
+bool flasher::_verify_read(size_t first, size_t count) {
+  size_t known = m_mismatches.size();
+  for (unsigned int attempt = 0; !_verify_range(first, count); attempt++) {
+    if (attempt == sector_retries) {
+      return false;
+    }
+    m_log->warn() << "Verify of sectors " << std::dec << first << ".."
+                  << first + count - 1 << " failed, retrying" << std::endl;
+    m_sector_retries++;
+    m_mismatches.resize(known);
+    if (!_resync()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool flasher::_verify_retry(size_t first, size_t count) {
+  size_t known = m_mismatches.size();
+  if (!_verify_read(first, count)) {
+    return false;
+  }
+
+  // A reply corrupted on the line looks just like a mismatch, so a sector
+  // only counts as mismatching once two reads differ at the same place
+  auto seen = std::vector<std::pair<size_t, size_t>>(
+      m_mismatches.begin() + known, m_mismatches.end());
+  std::vector<size_t> suspects;
+  for (auto &range : seen) {
+    size_t last = (range.second - 1) / sector_size;
+    for (size_t sector = range.first / sector_size; sector <= last; sector++) {
+      if (suspects.empty() || suspects.back() != sector) {
+        suspects.push_back(sector);
+      }
+    }
+  }
+  if (suspects.empty()) {
+    return true;
+  }
+  m_mismatches.resize(known);
+  for (size_t sector : suspects) {
+    if (m_fail_fast && m_mismatches.size() > known) {
+      break;
+    }
+    for (unsigned int attempt = 0; attempt < sector_retries; attempt++) {
+      m_log->warn() << "Mismatch in sector " << std::dec << sector
+                    << ", reading it again" << std::endl;
+      m_sector_retries++;
+      size_t before = m_mismatches.size();
+      if (!_verify_read(sector, 1)) {
         return false;
       }
-      append_byte(flash, sector_offset, bytes_read++, read_cont[1]);
-      append_byte(flash, sector_offset, bytes_read++, read_cont[2]);
-      append_byte(flash, sector_offset, bytes_read++, read_cont[3]);
+      bool confirmed = false;
+      for (size_t i = before; i < m_mismatches.size(); i++) {
+        for (auto &range : seen) {
+          confirmed |= m_mismatches[i].first < range.second &&
+                       range.first < m_mismatches[i].second;
+        }
+      }
+      if (m_mismatches.size() == before || confirmed ||
+          attempt + 1 == sector_retries) {
+        break;
+      }
+      seen.insert(seen.end(), m_mismatches.begin() + before,
+                  m_mismatches.end());
+      m_mismatches.resize(before);
     }
-    sector += 32;
   }
 
+  // Fail fast stopped reading the run at the false mismatch
+  size_t resume = suspects.back() + 1;
+  if (m_fail_fast && m_mismatches.size() == known && resume < first + count) {
+    return _verify_retry(resume, first + count - resume);
+  }
   return true;
 }
 
-bool flasher::verify_flash(std::vector<std::byte> &flash) {
-  for (size_t i = 0; i < m_file_buffer.size(); i++) {
-    if (m_file_buffer[i] != flash[i]) {
-      m_log->error() << "Verify flash failed at position " << std::dec << i
-                     << std::endl;
-      m_log->error() << "0x" << std::hex
-                     << std::to_integer<int>(m_file_buffer[i]) << " != "
-                     << "0x" << std::hex << std::to_integer<int>(flash[i])
-                     << std::endl;
+bool flasher::_verify_sectors(std::vector<std::byte> &flash,
+                              const std::vector<size_t> &sectors) {
+  m_mismatches.clear();
+  for (size_t i = 0; i < sectors.size();) {
+    if (m_fail_fast && !m_mismatches.empty()) {
+      break;
+    }
+
+    // A readback done for dumping already holds everything
+    if (flash.size() >= m_file_buffer.size()) {
+      size_t position = sectors[i++] * sector_size;
+      for (size_t end = position + sector_size; position < end; position++) {
+        _check(position, flash[position]);
+      }
+      continue;
+    }
+
+    // Read runs of consecutive sectors, sectors is sorted
+    size_t count = 1;
+    while (i + count < sectors.size() && count < read_chunk_sectors &&
+           sectors[i + count] == sectors[i] + count) {
+      count++;
+    }
+    if (!_verify_retry(sectors[i], count)) {
       return false;
     }
+    i += count;
   }
-  return true;
+
+  if (m_mismatches.empty()) {
+    return true;
+  }
+  size_t position = m_mismatches.front().first;
+  m_log->error() << "Verify flash failed at position " << std::dec << position
+                 << ": 0x" << std::hex
+                 << std::to_integer<int>(m_file_buffer[position]) << " != 0x"
+                 << std::to_integer<int>(m_mismatch_data) << std::endl;
+  if (!m_fail_fast) {
+    size_t bytes = 0;
+    for (auto &range : m_mismatches) {
+      m_log->error() << "Mismatch 0x" << std::hex << range.first << "..0x"
+                     << range.second - 1 << std::dec << " ("
+                     << range.second - range.first << " bytes)" << std::endl;
+      bytes += range.second - range.first;
+    }
+    m_log->error() << "Verify flash: " << std::dec << m_mismatches.size()
+                   << " mismatching ranges, " << bytes << " bytes"
+                   << std::endl;
+  }
+  return false;
+}
+
+bool flasher::verify_flash(std::vector<std::byte> &flash,
+                           verify_policy_t policy, unsigned int coverage) {
+  auto start = std::chrono::steady_clock::now();
+  size_t commands = m_serif.stats().commands;
+  std::vector<size_t> sectors;
+  std::string name;
+
+  switch (policy) {
+  case VERIFY_FULL:
+    name = "full";
+    sectors = m_range;
+    break;
+  case VERIFY_WRITTEN:
+    name = "written";
+    sectors = m_written;
+    std::sort(sectors.begin(), sectors.end());
+    break;
+  case VERIFY_SAMPLED: {
+    name = "sampled " + std::to_string(coverage) + "%";
+    sectors = m_range;
+    size_t count = static_cast<size_t>(
+        std::ceil(sectors.size() * std::min(coverage, 100u) / 100.0));
+    unsigned int seed = std::random_device{}();
+    m_log->debug() << "Verify sample seed " << std::dec << seed << std::endl;
+    std::mt19937 rng(seed);
+    std::shuffle(sectors.begin(), sectors.end(), rng);
+    sectors.resize(std::min(std::max<size_t>(count, 1), sectors.size()));
+    std::sort(sectors.begin(), sectors.end());
+    break;
+  }
+  case VERIFY_CRC:
+    // write_flash only succeeds after the chip confirmed the CRC32
+    name = "crc";
+    break;
+  }
+
+  bool ok = _verify_sectors(flash, sectors);
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  m_log->msg() << "Verify " << name << ": " << std::dec << sectors.size()
+               << " of " << max_sectors << " sectors, "
+               << m_serif.stats().commands - commands << " commands in "
+               << elapsed.count() << " s" << std::endl;
+  return ok;
 }
 
 bool flasher::erase_flash() {
-  buffer cmd(CMD_ERASE_CHIP);
-  if (!_write_cmd("Erasing flash", cmd)) {
-    return false;
+  bool ok = _retry("Erase flash", [this]() {
+    buffer cmd(CMD_ERASE_CHIP);
+    if (!_write_cmd("Erasing flash", cmd)) {
+      return false;
+    }
+    return _check_state(POLL_CHIP_ERASE, CMD_FLASH_STATE_BIT, false);
+  });
+  // A chip erase clears the lock bytes. Whether the NVR survives is up to
+  // the silicon, so set_nvr reads it again instead of trusting a copy.
+  if (ok) {
+    m_lockbits.assign(NVR_LOCK_BYTES, std::byte{0xFF});
+  } else {
+    m_lockbits.clear();
   }
-  return _check_state(10, CMD_FLASH_STATE_BIT, false);
+  m_nvr.clear();
+  return ok;
 }
 
-bool flasher::read_nvr(std::vector<std::byte> &nvr) {
-  for (int i = NVR_START; i <= NVR_STOP; i++) {
+void flasher::_changed(const std::vector<std::byte> &known,
+                       const std::vector<std::byte> &want, size_t count,
+                       std::vector<size_t> &changed) {
+  changed.clear();
+  for (size_t i = 0; i < count; i++) {
+    if (known.size() != count || known[i] != want[i]) {
+      changed.push_back(i);
+    }
+  }
+}
+
+bool flasher::_read_nvr(const std::vector<size_t> &offsets,
+                        std::vector<std::byte> &data) {
+  data.assign(offsets.size(), std::byte{0});
+  for (size_t i = 0; i < offsets.size(); i++) {
     buffer read_nvr(CMD_READ_NVR);
-    read_nvr[2] = static_cast<std::byte>(i);
-    if (!_read_cmd("Read nvr", read_nvr)) {
+    read_nvr[2] = static_cast<std::byte>(NVR_START + offsets[i]);
+    std::byte *out = &data[i];
+    if (!_queue_read_cmd("Read nvr", read_nvr,
+                         [out](buffer &reply) { *out = reply[3]; })) {
       m_log->error() << "Failed " << read_nvr << std::endl;
       return false;
     }
-    nvr.push_back(read_nvr[3]);
+  }
+  return m_serif.flush();
+}
+
+bool flasher::_read_lockbits(const std::vector<size_t> &offsets,
+                             std::vector<std::byte> &data) {
+  data.assign(offsets.size(), std::byte{0});
+  for (size_t i = 0; i < offsets.size(); i++) {
+    buffer read_lockbits(CMD_READ_LOCK_BITS);
+    read_lockbits[1] = static_cast<std::byte>(offsets[i]);
+    std::byte *out = &data[i];
+    if (!_queue_read_cmd("Read lockbits", read_lockbits,
+                         [out](buffer &reply) { *out = reply[3]; })) {
+      m_log->error() << "Failed!" << std::endl;
+      return false;
+    }
+  }
+  return m_serif.flush();
+}
+
+bool flasher::_check_written(const std::string &what,
+                             const std::vector<size_t> &offsets,
+                             const std::vector<std::byte> &want,
+                             const std::vector<std::byte> &data) {
+  for (size_t i = 0; i < offsets.size(); i++) {
+    if (data[i] != want[offsets[i]]) {
+      m_log->error() << what << " failed at offset " << std::dec << offsets[i]
+                     << ": 0x" << std::hex
+                     << std::to_integer<int>(want[offsets[i]]) << " != 0x"
+                     << std::to_integer<int>(data[i]) << std::endl;
+      return false;
+    }
   }
   return true;
 }
 
-bool flasher::set_nvr(std::vector<std::byte> &nvr) {
-  for (int i = NVR_START; i <= NVR_STOP; i++) {
-    buffer set_nvr(CMD_SET_NVR);
-    set_nvr[2] = static_cast<std::byte>(i);
-    set_nvr[3] = nvr.data()[i - NVR_START];
-    if (!_write_cmd("Set nvr", set_nvr)) {
-      m_log->error() << "Failed " << set_nvr << std::endl;
+bool flasher::_read_cached_nvr(std::vector<std::byte> &nvr) {
+  // The UUID names the cache entry, the CRC16 covers the calibration and
+  // keys, so a chip whose NVR was rewritten elsewhere is read in full again
+  std::vector<size_t> offsets;
+  for (size_t i = 0; i < NVR_UUID_SIZE; i++) {
+    offsets.push_back(offsetof(nvr_config_t, crc_protected.uuid) + i);
+  }
+  for (size_t i = 0; i < NVR_CRC16_SIZE; i++) {
+    offsets.push_back(offsetof(nvr_config_t, crc) + i);
+  }
+  std::vector<std::byte> data;
+  if (!_retry("Read nvr", [&]() { return _read_nvr(offsets, data); })) {
+    return false;
+  }
+  std::vector<std::byte> identity = m_signature;
+  identity.insert(identity.end(), data.begin(),
+                  data.begin() + NVR_UUID_SIZE);
+  std::vector<std::byte> cached;
+  if (!m_nvr_cache.load(identity, cached)) {
+    return false;
+  }
+  for (size_t i = 0; i < offsets.size(); i++) {
+    if (cached[offsets[i]] != data[i]) {
+      m_log->info() << "NVR changed since it was cached" << std::endl;
       return false;
     }
   }
+  m_log->info() << "NVR taken from cache, " << std::dec << offsets.size()
+                << " of " << nvr_bytes << " bytes read" << std::endl;
+  nvr = cached;
   return true;
 }
 
-bool flasher::read_lockbits(std::vector<std::byte> &lockbits) {
-  unsigned char i = 0;
-  for (i = 0; i < NVR_LOCK_BYTES; i++) {
-    buffer read_lockbits(CMD_READ_LOCK_BITS);
-    read_lockbits[1] = std::byte{i};
-    if (!_read_cmd("Read lockbits", read_lockbits)) {
-      m_log->error() << "Failed!" << std::endl;
+bool flasher::chip_identity(std::vector<std::byte> &identity) {
+  // The UUID comes from the known NVR if there is one, a read otherwise
+  size_t uuid = offsetof(nvr_config_t, crc_protected.uuid);
+  std::vector<std::byte> data;
+  if (m_nvr.size() == nvr_bytes) {
+    data.assign(m_nvr.begin() + uuid, m_nvr.begin() + uuid + NVR_UUID_SIZE);
+  } else {
+    std::vector<size_t> offsets(NVR_UUID_SIZE);
+    std::iota(offsets.begin(), offsets.end(), uuid);
+    if (!m_serif.flush() ||
+        !_retry("Read UUID", [&]() { return _read_nvr(offsets, data); })) {
       return false;
     }
-    lockbits.push_back(read_lockbits[3]);
-    m_log->info() << "Lockbyte[" << static_cast<int>(i) << "]: 0b"
-                  << std::bitset<8>(
-                         static_cast<unsigned char>(read_lockbits[3]))
-                  << std::endl;
-    std::this_thread::sleep_for(std::chrono::milliseconds(polling_timeout));
   }
+  identity = m_signature;
+  identity.insert(identity.end(), data.begin(), data.end());
   return true;
 }
 
-bool flasher::set_lockbits(std::vector<std::byte> &lockbits) {
-  unsigned char i = 0;
-  for (i = 0; i < NVR_LOCK_BYTES; i++) {
-    buffer set_lockbits(CMD_SET_LOCK_BITS);
-    set_lockbits[1] = std::byte{i};
-    set_lockbits[3] = lockbits.data()[i];
-    if (!_write_cmd("Write lockbits", set_lockbits)) {
-      m_log->error() << "Failed!" << std::endl;
+void flasher::_store_nvr() {
+  if (!m_nvr_cache.enabled() || m_nvr.size() != nvr_bytes ||
+      !nvr::crc_valid(m_nvr)) {
+    return;
+  }
+  std::vector<std::byte> identity = m_signature;
+  auto uuid = m_nvr.begin() + offsetof(nvr_config_t, crc_protected.uuid);
+  identity.insert(identity.end(), uuid, uuid + NVR_UUID_SIZE);
+  m_nvr_cache.store(identity, m_nvr);
+}
+
+bool flasher::read_nvr(std::vector<std::byte> &nvr) {
+  if (!m_serif.flush()) {
+    return false;
+  }
+  std::vector<std::byte> data;
+  if (m_nvr_cache.enabled() && _read_cached_nvr(data)) {
+    nvr.insert(nvr.end(), data.begin(), data.end());
+    m_nvr = data;
+    m_nvr_cached = true;
+    return true;
+  }
+
+  // The reads are independent, so they are pipelined and the whole area is
+  // read again on a line error
+  std::vector<size_t> offsets(nvr_bytes);
+  std::iota(offsets.begin(), offsets.end(), 0);
+  if (!_retry("Read nvr", [&]() { return _read_nvr(offsets, data); })) {
+    return false;
+  }
+  nvr.insert(nvr.end(), data.begin(), data.end());
+  m_nvr = data;
+  m_nvr_cached = false;
+  _store_nvr();
+  return true;
+}
+
+bool flasher::set_nvr(std::vector<std::byte> &nvr) {
+  // Only the bytes that differ from the device are written and read back,
+  // reading an unknown NVR first costs no more than writing it blindly.
+  // Every byte goes to a fixed address, a failed run is simply repeated.
+  // An unknown NVR is read in full. The cache only vouches for the CRC
+  // protected part and the CRC, the rest of a cached copy is read again.
+  std::vector<size_t> offsets;
+  if (m_nvr.size() != nvr_bytes) {
+    offsets.resize(nvr_bytes);
+    std::iota(offsets.begin(), offsets.end(), 0);
+  } else if (m_nvr_cached) {
+    size_t first = offsetof(nvr_config_t, crc_protected);
+    size_t last = offsetof(nvr_config_t, crc) + NVR_CRC16_SIZE;
+    for (size_t i = 0; i < nvr_bytes; i++) {
+      if (i < first || i >= last) {
+        offsets.push_back(i);
+      }
+    }
+  }
+  if (!offsets.empty()) {
+    std::vector<std::byte> data;
+    if (!m_serif.flush() ||
+        !_retry("Read nvr", [&]() { return _read_nvr(offsets, data); })) {
+      m_nvr.clear();
       return false;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(polling_timeout));
+    m_nvr.resize(nvr_bytes);
+    for (size_t i = 0; i < offsets.size(); i++) {
+      m_nvr[offsets[i]] = data[i];
+    }
+    m_nvr_cached = false;
+  }
+  std::vector<size_t> changed;
+  _changed(m_nvr, nvr, nvr_bytes, changed);
+  m_log->info() << "Set nvr: " << std::dec << changed.size() << " of "
+                << nvr_bytes << " bytes changed" << std::endl;
+  if (!m_serif.flush()) {
+    return false;
+  }
+  bool ok = _retry("Set nvr", [this, &nvr, &changed]() {
+    for (size_t i : changed) {
+      buffer set_nvr(CMD_SET_NVR);
+      set_nvr[2] = static_cast<std::byte>(NVR_START + i);
+      set_nvr[3] = nvr[i];
+      if (!_write_cmd("Set nvr", set_nvr)) {
+        m_log->error() << "Failed " << set_nvr << std::endl;
+        return false;
+      }
+    }
+    std::vector<std::byte> data;
+    return _read_nvr(changed, data) &&
+           _check_written("Set nvr", changed, nvr, data);
+  });
+  if (ok) {
+    m_nvr.assign(nvr.begin(), nvr.begin() + nvr_bytes);
+    _store_nvr();
+  } else {
+    m_nvr.clear();
+  }
+  return ok;
+}
+
+bool flasher::read_lockbits(std::vector<std::byte> &lockbits) {
+  std::vector<size_t> offsets(NVR_LOCK_BYTES);
+  std::iota(offsets.begin(), offsets.end(), 0);
+  std::vector<std::byte> data;
+  if (!m_serif.flush() || !_retry("Read lockbits", [&]() {
+        return _read_lockbits(offsets, data);
+      })) {
+    return false;
+  }
+  for (size_t i = 0; i < data.size(); i++) {
+    m_log->info() << "Lockbyte[" << i << "]: 0b"
+                  << std::bitset<8>(static_cast<unsigned char>(data[i]))
+                  << std::endl;
   }
+  lockbits.insert(lockbits.end(), data.begin(), data.end());
+  m_lockbits = data;
   return true;
 }
 
+bool flasher::set_lockbits(std::vector<std::byte> &lockbits) {
+  // Lock bytes can only clear bits, unchanged ones are skipped like the NVR
+  std::vector<std::byte> device;
+  if (m_lockbits.size() != NVR_LOCK_BYTES && !read_lockbits(device)) {
+    return false;
+  }
+  std::vector<size_t> changed;
+  _changed(m_lockbits, lockbits, NVR_LOCK_BYTES, changed);
+  m_log->info() << "Set lockbits: " << std::dec << changed.size() << " of "
+                << NVR_LOCK_BYTES << " bytes changed" << std::endl;
+  if (!m_serif.flush()) {
+    return false;
+  }
+  bool ok = _retry("Write lockbits", [this, &lockbits, &changed]() {
+    for (size_t i : changed) {
+      buffer set_lockbits(CMD_SET_LOCK_BITS);
+      set_lockbits[1] = static_cast<std::byte>(i);
+      set_lockbits[3] = lockbits[i];
+      if (!_write_cmd("Write lockbits", set_lockbits)) {
+        m_log->error() << "Failed!" << std::endl;
+        return false;
+      }
+      if (!_check_state(POLL_LOCKBITS, CMD_FLASH_STATE_BIT, false)) {
+        return false;
+      }
+    }
+    std::vector<std::byte> data;
+    return _read_lockbits(changed, data) &&
+           _check_written("Write lockbits", changed, lockbits, data);
+  });
+  if (ok) {
+    m_lockbits.assign(lockbits.begin(), lockbits.begin() + NVR_LOCK_BYTES);
+  } else {
+    m_lockbits.clear();
+  }
+  return ok;
+}
+
 bool flasher::check_crc() {
+  // A line error must not pass for a good image, check_identical relies on
+  // this to skip the whole job
   buffer cmd(CMD_RUN_CRC_CHECK);
-  _write_cmd("Check CRC", cmd);
-  _check_state(50, CMD_CRC_BUSY_BIT, false);
-  std::byte state_byte;
-  _get_state_byte(state_byte);
-  if ((state_byte & CMD_CRC_DONE_BIT) == CMD_CRC_DONE_BIT) {
+  std::byte state_byte{0};
+  if (!_write_cmd("Check CRC", cmd) ||
+      !_check_state(POLL_CRC, CMD_CRC_BUSY_BIT, false) ||
+      !_get_state_byte(state_byte)) {
+    m_log->error() << "CRC check could not be run" << std::endl;
+    return false;
+  }
+  if ((state_byte & CMD_CRC_FAILED_BIT) == CMD_CRC_FAILED_BIT) {
+    m_log->debug() << "CRC check failed" << std::endl;
+  } else if ((state_byte & CMD_CRC_DONE_BIT) == CMD_CRC_DONE_BIT) {
     m_log->debug() << "CRC check done" << std::endl;
     return true;
-  } else if ((state_byte & CMD_CRC_FAILED_BIT) == CMD_CRC_FAILED_BIT) {
-    m_log->debug() << "CRC check failed" << std::endl;
   } else {
     m_log->debug() << "CRC check failed (unknown)" << std::endl;
   }
@@ -382,11 +1295,21 @@ bool flasher::disable_apm() {
   cmd[1] = std::byte(8);
   cmd[3] = std::byte(0b11111001);
   _write_cmd("Disable APM", cmd);
-  return _check_state(10, CMD_FLASH_STATE_BIT, false);
+  if (m_lockbits.size() == NVR_LOCK_BYTES) {
+    m_lockbits[8] &= cmd[3];
+  }
+  return _check_state(POLL_LOCKBITS, CMD_FLASH_STATE_BIT, false);
 }
 
 bool flasher::reset() {
   buffer cmd(CMD_RESET_CHIP);
-  _write_cmd("Reset", cmd);
+  if (!_write_cmd("Reset", cmd) || !m_serif.flush()) {
+    m_log->error() << "Failed to send reset" << std::endl;
+    return false;
+  }
+  if (!m_serif.run_lines(m_release_lines)) {
+    m_log->error() << "Failed to release RESET" << std::endl;
+    return false;
+  }
   return true;
 }
\ No newline at end of file
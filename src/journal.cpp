@@ -0,0 +1,181 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "journal.hpp"
+#include "crc.hpp"
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+// Linux headers
+#include <fcntl.h>
+#include <unistd.h>
+
+static uint32_t _digest(const std::vector<std::byte> &data) {
+  return crc::crc32(
+      reinterpret_cast<unsigned char *>(const_cast<std::byte *>(data.data())),
+      data.size());
+}
+
+static std::string _hex(const std::vector<std::byte> &data) {
+  std::ostringstream ss;
+  for (std::byte byte : data) {
+    ss << std::hex << std::setw(2) << std::setfill('0')
+       << std::to_integer<int>(byte);
+  }
+  return ss.str();
+}
+
+journal::journal(log_t log) : m_log(log) {}
+
+journal::~journal() {
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+}
+
+bool journal::open(const std::string &file, const std::vector<std::byte> &chip,
+                   const std::vector<std::byte> &image) {
+  std::ostringstream header;
+  header << JOURNAL_MAGIC << " " << std::hex << std::setw(8)
+         << std::setfill('0') << _digest(image) << " " << std::dec
+         << image.size() << " " << _hex(chip);
+  m_file = file;
+
+  bool resume = _load(header.str());
+  int flags = O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC);
+  m_fd = ::open(file.c_str(), flags, 0644);
+  if (m_fd < 0) {
+    m_log->error() << "Failed to open journal " << file << std::endl;
+    return false;
+  }
+  if (resume) {
+    m_log->msg() << "Resuming job from " << file << ", " << std::dec
+                 << m_sectors.size() << " sectors confirmed" << std::endl;
+    return true;
+  }
+  return _append(header.str());
+}
+
+bool journal::_load(const std::string &header) {
+  std::ifstream fs(m_file);
+  std::string line;
+  if (!fs || !std::getline(fs, line)) {
+    return false;
+  }
+  if (line != header) {
+    m_log->info() << "Journal " << m_file
+                  << " belongs to another image or chip, starting over"
+                  << std::endl;
+    return false;
+  }
+
+  // A line cut short by a crash fails to parse and is ignored
+  while (std::getline(fs, line)) {
+    std::istringstream ss(line);
+    std::string step;
+    ss >> step;
+    if (step == "erase") {
+      m_erased = true;
+    } else if (step == "nvr") {
+      std::string lockbits;
+      if (!(ss >> std::hex >> m_nvr >> lockbits) || lockbits.size() % 2) {
+        continue;
+      }
+      m_lockbits.clear();
+      for (size_t i = 0; i < lockbits.size(); i += 2) {
+        m_lockbits.push_back(static_cast<std::byte>(
+            std::stoul(lockbits.substr(i, 2), nullptr, 16)));
+      }
+      m_nvr_written = true;
+    } else if (step == "sector") {
+      size_t sector;
+      if (ss >> std::dec >> sector) {
+        m_sectors.insert(sector);
+      }
+    }
+  }
+  // Without a confirmed erase there is nothing to resume
+  m_loaded = m_erased;
+  return m_loaded;
+}
+
+bool journal::_append(const std::string &line) {
+  std::string entry = line + "\n";
+  if (::write(m_fd, entry.data(), entry.size()) !=
+          static_cast<ssize_t>(entry.size()) ||
+      ::fdatasync(m_fd) != 0) {
+    m_log->error() << "Failed to write journal " << m_file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool journal::resumed() { return m_loaded; }
+
+size_t journal::next_sector() {
+  size_t sector = 0;
+  while (m_sectors.count(sector)) {
+    sector++;
+  }
+  return sector;
+}
+
+bool journal::nvr_written(const std::vector<std::byte> &nvr,
+                          std::vector<std::byte> &lockbits) {
+  if (!m_nvr_written || m_nvr != _digest(nvr)) {
+    return false;
+  }
+  lockbits = m_lockbits;
+  return true;
+}
+
+bool journal::erased() {
+  m_erased = true;
+  return _append("erase");
+}
+
+bool journal::nvr(const std::vector<std::byte> &nvr,
+                  const std::vector<std::byte> &lockbits) {
+  std::ostringstream ss;
+  ss << "nvr " << std::hex << std::setw(8) << std::setfill('0')
+     << _digest(nvr) << " " << _hex(lockbits);
+  return _append(ss.str());
+}
+
+bool journal::sector(size_t sector) {
+  m_sectors.insert(sector);
+  return _append("sector " + std::to_string(sector));
+}
+
+bool journal::finish() {
+  if (m_fd < 0) {
+    return true;
+  }
+  ::close(m_fd);
+  m_fd = -1;
+  if (::unlink(m_file.c_str()) != 0) {
+    m_log->warn() << "Failed to remove journal " << m_file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool journal::discard() {
+  m_log->info() << "Dropping journal " << m_file << std::endl;
+  return finish();
+}
@@ -17,6 +17,8 @@
 
 #include "logger.hpp"
 #include "string.h"
+#include <cstdio>
+#include <sstream>
 
 constexpr const char *msg_error = "[ERROR]";
 constexpr const char *msg_warn = "[WARNING]";
@@ -32,6 +34,28 @@ logger::logger(log_level_t level) : m_level(level) {}
 
 int logger::_null_buffer::overflow(int c) { return c; }
 
+// Set while the thread's output is held back. Each thread has its own null
+// stream, discarding sets its state flags.
+static thread_local std::unique_ptr<std::ostringstream> held;
+
+std::ostream &logger::_out() {
+  return held ? static_cast<std::ostream &>(*held) : std::cout;
+}
+
+void logger::begin_buffer() { held = std::make_unique<std::ostringstream>(); }
+
+void logger::end_buffer() {
+  if (!held) {
+    return;
+  }
+  // Straight to stdio, std::cout and its format flags belong to the main
+  // thread. stdio locks the stream, so the text lands in one piece.
+  std::string text = held->str();
+  held.reset();
+  fwrite(text.data(), 1, text.size(), stdout);
+  fflush(stdout);
+}
+
 void logger::set_log_level(log_level_t level) { m_level = level; }
 
 std::ostream &logger::_msg(log_level_t level, const char *c_msg) {
@@ -41,14 +65,16 @@ std::ostream &logger::_msg(log_level_t level, const char *c_msg) {
       msg.append(" ");
     }
 
-    std::cout << msg;
-    return std::cout;
+    std::ostream &out = _out();
+    out << msg;
+    return out;
   } else {
-    return m_null_buffer;
+    static thread_local _null_buffer null;
+    return null;
   }
 }
 
-std::ostream &logger::msg() { return std::cout; }
+std::ostream &logger::msg() { return _out(); }
 
 std::ostream &logger::error() { return _msg(LOG_ERROR, msg_error); }
 
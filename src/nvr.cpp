@@ -246,4 +246,13 @@ bool nvr::export_preset(log_t log, std::string &of,
 
 unsigned char nvr::get_revision(std::vector<std::byte> &nvr) {
   return _get_nvr_config_pointer(nvr)->crc_protected.rev;
-}
\ No newline at end of file
+}
+bool nvr::crc_valid(const std::vector<std::byte> &nvr) {
+  nvr_config_t config;
+  memcpy(&config, nvr.data(), sizeof(config));
+  uint16_t crc16 =
+      crc::crc16(reinterpret_cast<unsigned char *>(&config.crc_protected),
+                 sizeof(config.crc_protected));
+  return config.crc[0] == ((crc16 & 0xFF00) >> 8) &&
+         config.crc[1] == (crc16 & 0x00FF);
+}
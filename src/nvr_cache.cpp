@@ -0,0 +1,83 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "nvr_cache.hpp"
+#include "nvr.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+nvr_cache::nvr_cache(log_t log) : m_log(log) {}
+
+void nvr_cache::open(const std::string &dir) { m_dir = dir; }
+
+bool nvr_cache::enabled() { return !m_dir.empty(); }
+
+std::string nvr_cache::_file(const std::vector<std::byte> &identity) {
+  std::ostringstream ss;
+  ss << m_dir << "/";
+  for (std::byte byte : identity) {
+    ss << std::hex << std::setw(2) << std::setfill('0')
+       << std::to_integer<int>(byte);
+  }
+  ss << ".nvr";
+  return ss.str();
+}
+
+bool nvr_cache::load(const std::vector<std::byte> &identity,
+                     std::vector<std::byte> &nvr) {
+  std::string file = _file(identity);
+  std::ifstream fs(file, std::ios::binary);
+  if (!fs) {
+    return false;
+  }
+  std::vector<char> data((std::istreambuf_iterator<char>(fs)),
+                         std::istreambuf_iterator<char>());
+  nvr.resize(data.size());
+  std::transform(data.begin(), data.end(), nvr.begin(),
+                 [](char c) { return static_cast<std::byte>(c); });
+  if (nvr.size() != NVR_STOP - NVR_START + 1 || !nvr::crc_valid(nvr)) {
+    m_log->warn() << "Ignoring damaged NVR cache entry " << file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool nvr_cache::store(const std::vector<std::byte> &identity,
+                      const std::vector<std::byte> &nvr) {
+  // Written aside and renamed, a concurrent reader never sees half a copy
+  std::string file = _file(identity);
+  std::string tmp = file + ".tmp";
+  {
+    std::ofstream fs(tmp, std::ios::binary | std::ios::trunc);
+    fs.write(reinterpret_cast<const char *>(nvr.data()),
+             static_cast<std::streamsize>(nvr.size()));
+    if (!fs) {
+      m_log->warn() << "Failed to write NVR cache entry " << tmp << std::endl;
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), file.c_str()) != 0) {
+    m_log->warn() << "Failed to write NVR cache entry " << file << std::endl;
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
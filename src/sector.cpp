@@ -0,0 +1,136 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "sector.hpp"
+
+constexpr std::byte erased{0xFF};
+
+// Re-addressing costs one WRITE_SRAM, streaming a hole of this many 0xFF
+// costs at least two CONT_WRITE_SRAM
+constexpr unsigned int jump_gap = 6;
+
+static unsigned int _skip_erased(const std::byte *data, unsigned int pos,
+                                 unsigned int end) {
+  while (pos < end && data[pos] == erased) {
+    pos++;
+  }
+  return pos;
+}
+
+static void _trim(const std::byte *data, unsigned int length,
+                  unsigned int &begin, unsigned int &end) {
+  begin = _skip_erased(data, 0, length);
+  end = length;
+  while (end > begin && data[end - 1] == erased) {
+    end--;
+  }
+}
+
+static void _stream(const std::byte *data, unsigned int begin,
+                    unsigned int end, std::vector<sector_step_t> &steps) {
+  steps.push_back({SECTOR_WRITE_BYTE, begin, {data[begin]}});
+  for (begin++; begin < end; begin += 3) {
+    steps.push_back({SECTOR_WRITE_BLOCK,
+                     begin,
+                     {data[begin], data[begin + 1], data[begin + 2]}});
+  }
+}
+
+void sector::plan(const std::byte *data, unsigned int length,
+                  std::vector<sector_step_t> &steps) {
+  unsigned int begin;
+  unsigned int end;
+
+  steps.clear();
+  _trim(data, length, begin, end);
+  if (begin == end) {
+    return;
+  }
+
+  // Every segment but the last may stream up to two bytes into the hole
+  // behind it, those are 0xFF anyway
+  unsigned int written = 0;
+  for (;;) {
+    unsigned int pos = begin + 1;
+    unsigned int next = end;
+    while (pos < end) {
+      unsigned int data_at = _skip_erased(data, pos, end);
+      if (data_at - pos >= jump_gap) {
+        next = data_at;
+        break;
+      }
+      pos += 3;
+    }
+
+    if (next != end) {
+      _stream(data, begin, pos, steps);
+      written = pos;
+      begin = next;
+      continue;
+    }
+
+    // The last block has to end exactly at end, so start up to two bytes
+    // early inside the 0xFF in front. If there is no room for that, write
+    // the surplus bytes one by one as before.
+    unsigned int offset = (end - begin - 1) % 3;
+    unsigned int shift = (3 - offset) % 3;
+    if (begin - written >= shift) {
+      begin -= shift;
+    } else {
+      for (unsigned int i = 0; i < offset; i++) {
+        steps.push_back({SECTOR_WRITE_BYTE, begin, {data[begin]}});
+        steps.push_back({SECTOR_PROGRAM, 0, {}});
+        begin++;
+      }
+    }
+    _stream(data, begin, end, steps);
+    break;
+  }
+
+  steps.push_back({SECTOR_PROGRAM, 0, {}});
+}
+
+void sector::plan_full(const std::byte *data, unsigned int length,
+                       std::vector<sector_step_t> &steps) {
+  steps.clear();
+  if (length == 0) {
+    return;
+  }
+  // Single bytes up front so the blocks end exactly at the sector end
+  unsigned int begin = 0;
+  for (; begin < (length - 1) % 3; begin++) {
+    steps.push_back({SECTOR_WRITE_BYTE, begin, {data[begin]}});
+  }
+  _stream(data, begin, length, steps);
+  steps.push_back({SECTOR_PROGRAM, 0, {}});
+}
+
+size_t sector::linear_commands(const std::byte *data, unsigned int length) {
+  unsigned int begin;
+  unsigned int end;
+
+  _trim(data, length, begin, end);
+  if (begin == end) {
+    return 0;
+  }
+
+  // Surplus bytes with a program each, one WRITE_SRAM, the blocks and the
+  // final program
+  unsigned int actual_length = end - begin;
+  unsigned int offset = (actual_length - 1) % 3;
+  return 2 * offset + 1 + (actual_length - 1 - offset) / 3 + 1;
+}
@@ -16,139 +16,522 @@
 // along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "serif.hpp"
+#include "session.hpp"
+#include <algorithm>
 #include <iostream>
 #include <thread>
-#include <vector>
 
 // Linux headers
 #include <errno.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <termios.h>
-#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
 
-serif::serif(const char *if_name, log_t log) : m_if_name(if_name), m_log(log) {}
+constexpr size_t max_window = SERIF_MAX_WINDOW;
+constexpr size_t max_resync = 16;
+// Longer than the frame timeout of the chip, so a partial command it still
+// holds is dropped before the line is used again
+constexpr std::chrono::milliseconds resync_quiet{60};
+constexpr std::chrono::milliseconds resync_limit{1000};
 
-serif::~serif() {
-  if (m_serif) {
-    close(m_serif);
+serif::serif(const char *if_name, log_t log)
+    : m_if_name(if_name), m_log(log),
+      m_transport(make_transport(if_name, log)) {}
+
+bool serif::open(unsigned char timeout) {
+  if (m_open) {
+    return true;
+  }
+
+  m_timeout = std::chrono::milliseconds(100 * timeout);
+  if (!m_transport || !m_transport->open(m_line)) {
+    return false;
+  }
+  m_open = true;
+  if (m_window_auto) {
+    m_window = m_transport->default_window();
+    m_log->debug() << "Command window " << std::dec << m_window << std::endl;
+  }
+  if (m_low_latency) {
+    m_transport->set_low_latency(true);
   }
+  return true;
 }
 
-bool serif::open(unsigned char timeout) {
+bool serif::wait_present(std::chrono::steady_clock::time_point deadline) {
+  if (m_open && !m_transport->present()) {
+    m_log->info() << "Device " << m_if_name << " disappeared" << std::endl;
+    auto *recording = dynamic_cast<record_transport *>(m_transport.get());
+    if (recording) {
+      recording->set_inner(make_transport(m_if_name, m_log));
+    } else {
+      m_transport = make_transport(m_if_name, m_log);
+    }
+    m_open = false;
+    _reset_window();
+  }
+  return m_transport->wait_present(deadline);
+}
 
-  if (m_serif > 0) {
+bool serif::set_line(const serif_line_t &line) {
+  m_line = line;
+  if (!m_open) {
     return true;
   }
-
-  m_log->debug() << "Opening port " << m_if_name << std::endl;
-  m_serif = ::open(m_if_name.c_str(), O_RDWR);
-  if (m_serif == 0) {
-    m_log->error() << "Failed to open " << m_if_name << std::endl;
+  if (!m_transport->set_line(line)) {
     return false;
   }
+  _drain();
+  return true;
+}
 
-  struct termios tty;
+const serif_line_t &serif::line() { return m_line; }
 
-  if (tcgetattr(m_serif, &tty) != 0) {
-    m_log->error() << "Failed to read settings " << m_if_name << std::endl;
+bool serif::run_lines(const std::vector<serif_line_step_t> &steps) {
+  if (steps.empty()) {
+    return true;
+  }
+  if (!m_open) {
+    m_log->error() << "Modem lines need an open port" << std::endl;
+    return false;
   }
+  for (auto &step : steps) {
+    if ((step.set | step.clear) &&
+        !m_transport->set_modem_lines(step.set, step.clear)) {
+      return false;
+    }
+    std::this_thread::sleep_for(step.hold);
+  }
+  // Whatever the chip sent while being reset is no reply to anything
+  _reset_window();
+  return true;
+}
 
-  tty.c_cflag &= ~PARENB;  // No parity
-  tty.c_cflag |= CSTOPB;   // Two stop bits
-  tty.c_cflag &= ~CSIZE;   // Clear all the size bits
-  tty.c_cflag |= CS8;      // 8 bits per byte (most common)
-  tty.c_cflag &= ~CRTSCTS; // No HW flow control
+void serif::set_low_latency(bool enable) {
+  if (enable == m_low_latency) {
+    return;
+  }
+  m_low_latency = enable;
+  if (m_open) {
+    m_transport->set_low_latency(enable);
+  }
+}
 
-  tty.c_lflag &= ~ICANON; // Disable canonical mode
-  tty.c_lflag &= ~ECHO;   // Disable echo
-  tty.c_lflag &= ~ECHOE;  // Disable erasure
-  tty.c_lflag &= ~ECHONL; // Disable new-line echo
-  tty.c_lflag &= ~ISIG;   // Disable interpretation of INTR, QUIT and SUSP
+bool serif::record(const std::string &file) {
+  if (m_open || !m_transport) {
+    m_log->error() << "Recording has to start before opening" << std::endl;
+    return false;
+  }
+  m_transport = std::make_unique<record_transport>(std::move(m_transport),
+                                                   file, m_log);
+  return true;
+}
 
-  tty.c_iflag &= ~(IXON | IXOFF | IXANY); // No sw flow ctrl
-  tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
-                   ICRNL); // No special handling of received bytes
-  tty.c_iflag |= IGNPAR;   // Ignore framing errors
+bool serif::replay(const std::string &file, bool realtime) {
+  if (m_open) {
+    m_log->error() << "Replay has to start before opening" << std::endl;
+    return false;
+  }
+  m_transport = std::make_unique<replay_transport>(file, realtime, m_log);
+  return true;
+}
 
-  tty.c_oflag &= ~OPOST; // No interpretation of output bytes
-  tty.c_oflag &= ~ONLCR; // No conv. of newline to carriage return/line feed
+bool serif::write_raw(std::byte *send, size_t length) {
+  struct iovec iov = {send, length};
+  return _write_all(&iov, 1);
+}
 
-  tty.c_cc[VTIME] = timeout; // Wait for up to 1s
-  tty.c_cc[VMIN] = 0;        // Wait always for four bytes
+std::chrono::steady_clock::time_point serif::_deadline() {
+  // No per command timeout leaves only the phase budget, if any
+  if (m_timeout.count() == 0) {
+    return m_phase_deadline;
+  }
+  return std::min(m_phase_deadline,
+                  std::chrono::steady_clock::now() + m_timeout);
+}
 
-  cfsetspeed(&tty, B115200); // Set baud rate to 115200
+void serif::begin_phase(std::chrono::milliseconds budget) {
+  m_phase_deadline = budget.count() > 0
+                         ? std::chrono::steady_clock::now() + budget
+                         : std::chrono::steady_clock::time_point::max();
+}
 
-  if (tcsetattr(m_serif, TCSANOW, &tty) != 0) {
-    m_log->error() << "Error " << std::dec << errno << " from tcsetattr"
-                   << std::endl;
-    return false;
+bool serif::_write_all(struct iovec *iov, size_t count) {
+  auto deadline = _deadline();
+  while (count) {
+    ssize_t n = m_transport->writev(iov, static_cast<int>(count));
+    m_stats.tx_writes++;
+    if (n < 0) {
+      if ((errno != EAGAIN && errno != EINTR) || !_wait(POLLOUT, deadline)) {
+        m_log->error() << "Write failed, errno " << std::dec << errno
+                       << std::endl;
+        return false;
+      }
+      continue;
+    }
+    m_stats.tx_bytes += static_cast<size_t>(n);
+    // Skip what went out and continue with the rest of a partial write
+    size_t written = static_cast<size_t>(n);
+    while (count && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count) {
+      iov->iov_base = static_cast<std::byte *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
   }
-  m_log->debug() << "Port open :-)" << std::endl;
   return true;
 }
 
-bool serif::write_raw(std::byte *send, size_t length) {
-  for (size_t i = 0; i < length; i++) {
-    if (::write(m_serif, &send[i], 1) != 1) {
+bool serif::_send_staged() {
+  struct iovec iov[SERIF_MAX_WINDOW];
+  size_t first = m_pending.size() - m_unsent;
+  auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < m_unsent; i++) {
+    pending_t &pending = m_pending[first + i];
+    iov[i] = {pending.cmd.data(), 4};
+    pending.sent = now;
+  }
+  size_t count = m_unsent;
+  m_unsent = 0;
+  return _write_all(iov, count);
+}
+
+bool serif::_wait(short events,
+                  std::chrono::steady_clock::time_point deadline) {
+  struct pollfd pfd = {m_transport->fd(), events, 0};
+  while (true) {
+    int wait = -1;
+    if (deadline != std::chrono::steady_clock::time_point::max()) {
+      auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      wait = static_cast<int>(std::max<long>(0, remaining.count()));
+    }
+    int ret = poll(&pfd, 1, wait);
+    if (ret > 0) {
+      // A pulled USB adapter hangs up while still reporting readable
+      if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        errno = EPIPE;
+        return false;
+      }
+      return (pfd.revents & events) != 0;
+    }
+    if (ret == 0) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+    if (errno != EINTR) {
       return false;
     }
   }
+}
+
+bool serif::_fill(std::chrono::steady_clock::time_point deadline) {
+  size_t contiguous;
+  std::byte *tail = m_rx.tail(contiguous);
+  if (contiguous == 0) {
+    m_log->error() << "RX buffer overrun" << std::endl;
+    return false;
+  }
+  bool ready = false;
+  while (true) {
+    ssize_t n = m_transport->read(tail, contiguous);
+    if (n > 0) {
+      m_rx.commit(static_cast<size_t>(n));
+      return true;
+    }
+    // An idle tty reads 0, once poll() reported it readable that is a hang up
+    if (n == 0 && ready) {
+      errno = EPIPE;
+      break;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      break;
+    }
+    // Checked here as well, a stream of Telnet control sequences keeps the
+    // socket readable without ever yielding data
+    if (std::chrono::steady_clock::now() >= deadline) {
+      errno = ETIMEDOUT;
+      break;
+    }
+    if (!_wait(POLLIN, deadline)) {
+      break;
+    }
+    ready = true;
+  }
+  if (errno != ETIMEDOUT) {
+    m_log->error() << "Link lost, errno " << std::dec << errno << std::endl;
+    return false;
+  }
+  m_stats.timeouts++;
+  m_log->error() << "Timeout with " << std::dec << m_rx.size()
+                 << " bytes pending"
+                 << (std::chrono::steady_clock::now() >= m_phase_deadline
+                         ? ", phase budget exhausted"
+                         : "")
+                 << std::endl;
+  return false;
+}
+
+size_t serif::_find_frame(buffer &expect, size_t echo_bytes) {
+  // A full echo is strong evidence even several frames further on. A bare
+  // opcode is not, data bytes take the same values, so a read reply has to
+  // start right at the head.
+  size_t limit = (echo_bytes == 4) ? max_resync : 0;
+  for (size_t offset = 0; offset <= limit && offset + 4 <= m_rx.size();
+       offset++) {
+    size_t i = 0;
+    while (i < echo_bytes && m_rx[offset + i] == expect[i]) {
+      i++;
+    }
+    if (i == echo_bytes) {
+      return offset;
+    }
+  }
+  return SERIF_RX_SIZE;
+}
+
+bool serif::_next_frame(buffer &expect, size_t echo_bytes, buffer &reply) {
+  auto deadline = _deadline();
+  size_t offset = 0;
+  while (true) {
+    while (m_rx.size() < 4) {
+      if (!_fill(deadline)) {
+        return false;
+      }
+    }
+    offset = _find_frame(expect, echo_bytes);
+    if (offset != SERIF_RX_SIZE) {
+      break;
+    }
+    // Nothing lines up yet, either the reply is still arriving or it is wrong.
+    // Give up once the search window is covered and hand out the head so the
+    // caller reports the mismatch.
+    if (echo_bytes < 4 || m_rx.size() >= 4 + max_resync || !_fill(deadline)) {
+      offset = 0;
+      break;
+    }
+  }
+
+  if (offset) {
+    m_log->warn() << "Resync: skipped " << std::dec << offset
+                  << " bytes before reply to " << expect << std::endl;
+    m_stats.resyncs++;
+    m_stats.dropped_bytes += offset;
+    m_rx.pop_front(offset);
+  }
+  for (size_t i = 0; i < 4; i++) {
+    reply[i] = m_rx[i];
+  }
+  m_rx.pop_front(4);
   return true;
 }
 
 bool serif::read_raw(std::byte *recv, size_t length) {
-  size_t bytes = bytes_available();
-  while (bytes < length) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    bytes = bytes_available();
+  auto deadline = _deadline();
+  while (m_rx.size() < length) {
+    if (!_fill(deadline)) {
+      return false;
+    }
   }
-  if (bytes == length) {
-    return (::read(m_serif, recv, length) > 0);
-  } else {
-    std::vector<std::byte> tmp_buffer;
-    tmp_buffer.resize(bytes);
-    ::read(m_serif, tmp_buffer.data(), bytes);
-    recv[0] = tmp_buffer[bytes - 4];
-    recv[1] = tmp_buffer[bytes - 3];
-    recv[2] = tmp_buffer[bytes - 2];
-    recv[3] = tmp_buffer[bytes - 1];
+  for (size_t i = 0; i < length; i++) {
+    recv[i] = m_rx[i];
   }
+  m_rx.pop_front(length);
   return true;
 }
 
+bool serif::resync() {
+  // Forget what is in flight and discard everything until the line has
+  // been quiet for a while
+  _reset_window();
+  auto limit = std::min(m_phase_deadline,
+                        std::chrono::steady_clock::now() + resync_limit);
+  while (std::chrono::steady_clock::now() < limit) {
+    if (!_wait(POLLIN, std::min(limit, std::chrono::steady_clock::now() +
+                                           resync_quiet))) {
+      return errno == ETIMEDOUT;
+    }
+    std::byte discard[64];
+    ssize_t n = m_transport->read(discard, sizeof(discard));
+    if (n > 0) {
+      m_stats.dropped_bytes += static_cast<size_t>(n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      return false;
+    }
+  }
+  m_log->error() << "Line did not calm down for resync" << std::endl;
+  return false;
+}
+
+void serif::_drain() {
+  m_transport->drain();
+  m_rx.clear();
+}
+
+void serif::_record_latency(std::chrono::steady_clock::time_point sent) {
+  auto latency = std::chrono::steady_clock::now() - sent;
+  m_stats.total += latency;
+  m_stats.min = std::min(m_stats.min, latency);
+  m_stats.max = std::max(m_stats.max, latency);
+}
+
 bool serif::write_cmd(buffer &cmd) {
+  if (!flush()) {
+    return false;
+  }
   m_log->debug() << "Write Cmd " << cmd << std::endl;
+  m_stats.commands++;
   buffer recv;
+  auto sent = std::chrono::steady_clock::now();
   if (!write_raw(cmd.data(), 4)) {
     m_log->error() << "Write Cmd failed " << cmd << std::endl;
     return false;
   }
-  std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  if (!read_raw(recv.data(), 4)) {
-    m_log->error() << "Echo Cmd failed " << recv << std::endl;
+  if (!_next_frame(cmd, 4, recv)) {
+    m_log->error() << "Echo Cmd failed " << cmd << std::endl;
     return false;
   }
+  _record_latency(sent);
   m_log->debug() << "Read Cmd " << recv << std::endl;
   return (cmd == recv);
 }
 
 bool serif::read_cmd(buffer &cmd) {
+  if (!flush()) {
+    return false;
+  }
   m_log->debug() << "Read Cmd " << cmd << std::endl;
+  m_stats.commands++;
+  auto sent = std::chrono::steady_clock::now();
+  buffer expect = cmd;
   if (!write_raw(cmd.data(), 4)) {
     return false;
   }
-  std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  if (!read_raw(cmd.data(), 4)) {
+  if (!_next_frame(expect, 1, cmd)) {
     return false;
   }
+  _record_latency(sent);
   m_log->debug() << "Relpy    " << cmd << std::endl;
+  if (cmd[0] != expect[0]) {
+    m_log->error() << "Reply mismatch for " << expect << "got " << cmd
+                   << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool serif::queue_write_cmd(buffer &cmd) { return _queue(cmd, nullptr); }
+
+bool serif::queue_read_cmd(buffer &cmd,
+                           std::function<void(buffer &)> on_reply) {
+  return _queue(cmd, on_reply);
+}
+
+bool serif::_queue(buffer &cmd, std::function<void(buffer &)> on_reply) {
+  m_log->debug() << "Queue Cmd " << cmd << std::endl;
+  m_stats.commands++;
+  m_pending.push_back({cmd, on_reply, std::chrono::steady_clock::now()});
+  m_unsent++;
+  if (m_pending.size() < m_window) {
+    return true;
+  }
+
+  // Window is full: send everything staged in one go, block for the oldest
+  // reply and take whatever else has already arrived
+  if (!_send_staged()) {
+    m_log->error() << "Write Cmd failed " << cmd << std::endl;
+    _reset_window();
+    return false;
+  }
+  do {
+    if (!_complete_one()) {
+      return false;
+    }
+  } while (!m_pending.empty() && m_rx.size() >= 4);
+  return true;
+}
+
+void serif::_reset_window() {
+  m_pending.clear();
+  m_unsent = 0;
+  _drain();
+}
+
+bool serif::_complete_one() {
+  pending_t &pending = m_pending.front();
+  buffer recv;
+
+  // Read replies only carry the opcode as echo, the rest is payload
+  bool ok = _next_frame(pending.cmd, pending.on_reply ? 1 : 4, recv);
+  if (!ok) {
+    m_log->error() << "Reply failed for " << pending.cmd << std::endl;
+  } else if (pending.on_reply && recv[0] == pending.cmd[0]) {
+    _record_latency(pending.sent);
+    m_log->debug() << "Relpy    " << recv << std::endl;
+    pending.on_reply(recv);
+  } else if (pending.cmd == recv) {
+    _record_latency(pending.sent);
+  } else {
+    m_log->error() << "Echo mismatch for " << pending.cmd << "got " << recv
+                   << std::endl;
+    ok = false;
+  }
+
+  if (!ok) {
+    m_log->error() << "Dropping " << std::dec << m_pending.size() - 1
+                   << " queued commands" << std::endl;
+    _reset_window();
+    return false;
+  }
+  m_pending.pop_front();
+  return true;
+}
+
+bool serif::flush() {
+  if (m_unsent && !_send_staged()) {
+    _reset_window();
+    return false;
+  }
+  while (!m_pending.empty()) {
+    if (!_complete_one()) {
+      return false;
+    }
+  }
   return true;
 }
 
+void serif::set_window(size_t depth) {
+  // Zero leaves the choice to the transport once the port is open
+  m_window_auto = (depth == 0);
+  if (depth > max_window) {
+    m_log->warn() << "Command window " << std::dec << depth
+                  << " out of range, clamping to " << max_window << std::endl;
+  }
+  m_window = std::max<size_t>(1, std::min(depth, max_window));
+}
+
+const serif_stats_t &serif::stats() { return m_stats; }
+
+size_t serif::wait_bytes(size_t count, std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (m_rx.size() < count && _wait(POLLIN, deadline)) {
+    size_t contiguous;
+    std::byte *tail = m_rx.tail(contiguous);
+    if (contiguous == 0) {
+      break;
+    }
+    ssize_t n = m_transport->read(tail, contiguous);
+    if (n > 0) {
+      m_rx.commit(static_cast<size_t>(n));
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      break;
+    }
+  }
+  return m_rx.size();
+}
+
 size_t serif::bytes_available() {
-  int bytes;
-  ioctl(m_serif, FIONREAD, &bytes);
-  m_log->debug() << "Bytes available " << bytes << std::endl;
-  return static_cast<size_t>(bytes);
+  return m_rx.size() + m_transport->bytes_available();
 }
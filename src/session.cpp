@@ -0,0 +1,347 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "session.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+// Linux headers
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+constexpr size_t magic_size = sizeof(SESSION_MAGIC);
+
+record_transport::record_transport(std::unique_ptr<transport> inner,
+                                   const std::string &file, log_t log)
+    : m_inner(std::move(inner)), m_file(file), m_log(log) {}
+
+record_transport::~record_transport() {
+  if (m_fs.is_open()) {
+    m_log->info() << "Recorded " << std::dec << m_records << " chunks to "
+                  << m_file << std::endl;
+  }
+}
+
+bool record_transport::open(const serif_line_t &line) {
+  // Reopening after a replug appends to the session
+  if (!m_fs.is_open()) {
+    m_fs.open(m_file, std::ios::binary | std::ios::trunc);
+    if (!m_fs) {
+      m_log->error() << "Failed to create session file " << m_file
+                     << std::endl;
+      return false;
+    }
+    m_fs.write(SESSION_MAGIC, magic_size);
+    m_last = std::chrono::steady_clock::now();
+  }
+  return m_inner->open(line);
+}
+
+void record_transport::set_inner(std::unique_ptr<transport> inner) {
+  m_inner = std::move(inner);
+}
+
+int record_transport::fd() { return m_inner->fd(); }
+
+void record_transport::_varint(uint64_t value) {
+  do {
+    unsigned char byte = value & 0x7F;
+    value >>= 7;
+    m_fs.put(static_cast<char>(byte | (value ? 0x80 : 0)));
+  } while (value);
+}
+
+void record_transport::_record(unsigned char type, const std::byte *data,
+                               size_t length) {
+  auto now = std::chrono::steady_clock::now();
+  auto delta =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last);
+  m_last = now;
+  m_fs.put(static_cast<char>(type));
+  _varint(static_cast<uint64_t>(delta.count()));
+  _varint(length);
+  m_fs.write(reinterpret_cast<const char *>(data),
+             static_cast<std::streamsize>(length));
+  m_records++;
+}
+
+ssize_t record_transport::read(std::byte *data, size_t length) {
+  ssize_t n = m_inner->read(data, length);
+  if (n > 0) {
+    _record(SESSION_RX, data, static_cast<size_t>(n));
+  }
+  return n;
+}
+
+ssize_t record_transport::writev(const struct iovec *iov, int count) {
+  ssize_t n = m_inner->writev(iov, count);
+  if (n <= 0) {
+    return n;
+  }
+  // Only what actually went out, a short write is recorded as such
+  std::vector<std::byte> sent;
+  size_t left = static_cast<size_t>(n);
+  for (int i = 0; i < count && left; i++) {
+    size_t chunk = std::min(left, iov[i].iov_len);
+    auto *base = static_cast<const std::byte *>(iov[i].iov_base);
+    sent.insert(sent.end(), base, base + chunk);
+    left -= chunk;
+  }
+  _record(SESSION_TX, sent.data(), sent.size());
+  return n;
+}
+
+size_t record_transport::bytes_available() {
+  return m_inner->bytes_available();
+}
+
+void record_transport::drain() { m_inner->drain(); }
+
+bool record_transport::set_line(const serif_line_t &line) {
+  return m_inner->set_line(line);
+}
+
+void record_transport::set_low_latency(bool enable) {
+  m_inner->set_low_latency(enable);
+}
+
+size_t record_transport::default_window() {
+  return m_inner->default_window();
+}
+
+bool record_transport::set_modem_lines(unsigned int set,
+                                       unsigned int clear) {
+  return m_inner->set_modem_lines(set, clear);
+}
+
+bool record_transport::present() { return m_inner->present(); }
+
+bool record_transport::wait_present(
+    std::chrono::steady_clock::time_point deadline) {
+  return m_inner->wait_present(deadline);
+}
+
+replay_transport::replay_transport(const std::string &file, bool realtime,
+                                   log_t log)
+    : m_file(file), m_realtime(realtime), m_log(log) {}
+
+replay_transport::~replay_transport() {
+  if (m_timer < 0) {
+    return;
+  }
+  size_t rx_left = 0;
+  for (size_t i = m_rx_next; i < m_rx.size(); i++) {
+    rx_left += m_rx[i].data.size();
+  }
+  rx_left -= m_rx_next_offset;
+  m_log->info() << "Replay: " << std::dec << m_tx_written << " of "
+                << m_tx.size() << " recorded bytes sent, " << m_tx_diverged
+                << " differed, " << rx_left << " received bytes left"
+                << std::endl;
+  close(m_timer);
+}
+
+bool replay_transport::_load() {
+  std::ifstream fs(m_file, std::ios::binary);
+  if (!fs) {
+    m_log->error() << "Failed to open session file " << m_file << std::endl;
+    return false;
+  }
+  std::vector<unsigned char> raw((std::istreambuf_iterator<char>(fs)),
+                                 std::istreambuf_iterator<char>());
+  if (raw.size() < magic_size ||
+      std::memcmp(raw.data(), SESSION_MAGIC, magic_size) != 0) {
+    m_log->error() << m_file << " is not a session file" << std::endl;
+    return false;
+  }
+
+  size_t pos = magic_size;
+  auto varint = [&raw, &pos](uint64_t &value) {
+    value = 0;
+    for (unsigned int shift = 0; pos < raw.size() && shift < 64; shift += 7) {
+      unsigned char byte = raw[pos++];
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  std::chrono::nanoseconds time{0};
+  std::chrono::nanoseconds last_tx{0};
+  size_t rx_bytes = 0;
+  while (pos < raw.size()) {
+    unsigned char type = raw[pos++];
+    uint64_t delta;
+    uint64_t length;
+    if (!varint(delta) || !varint(length) || raw.size() - pos < length) {
+      // A recording cut short by a crash is still worth replaying
+      m_log->warn() << "Session file " << m_file << " is truncated"
+                    << std::endl;
+      break;
+    }
+    time += std::chrono::nanoseconds(delta);
+    auto *data = reinterpret_cast<std::byte *>(&raw[pos]);
+    if (type == SESSION_TX) {
+      m_tx.insert(m_tx.end(), data, data + length);
+      last_tx = time;
+    } else if (type == SESSION_RX) {
+      m_rx.push_back({m_tx.size(), rx_bytes, time - last_tx,
+                      std::vector<std::byte>(data, data + length)});
+      rx_bytes += length;
+    }
+    pos += length;
+  }
+  m_log->info() << "Replaying " << std::dec << m_tx.size() << " sent and "
+                << rx_bytes << " received bytes from " << m_file << " ("
+                << (m_realtime ? "original timing" : "maximum speed") << ")"
+                << std::endl;
+  return true;
+}
+
+bool replay_transport::open(const serif_line_t & /*line*/) {
+  m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (m_timer < 0) {
+    m_log->error() << "Failed to create replay timer" << std::endl;
+    return false;
+  }
+  return _load();
+}
+
+int replay_transport::fd() { return m_timer; }
+
+void replay_transport::_schedule() {
+  auto now = std::chrono::steady_clock::now();
+  while (m_rx_next < m_rx.size()) {
+    rx_record_t &record = m_rx[m_rx_next];
+    // Everything sent before it in the recording has gone out, or at least
+    // as many bytes as have been received up to here when the commands are
+    // batched differently than during the recording
+    size_t available = record.data.size();
+    if (m_tx_written < record.tx_before) {
+      available = std::min(available, m_tx_written > record.rx_offset
+                                          ? m_tx_written - record.rx_offset
+                                          : 0);
+    }
+    if (available <= m_rx_next_offset) {
+      break;
+    }
+    auto due = m_realtime ? now + record.response : now;
+    m_last_due = std::max(due, m_last_due);
+    m_due.push_back({m_last_due,
+                     std::vector<std::byte>(
+                         record.data.begin() + m_rx_next_offset,
+                         record.data.begin() + available)});
+    m_rx_next_offset = available;
+    if (available < record.data.size()) {
+      break;
+    }
+    m_rx_next++;
+    m_rx_next_offset = 0;
+  }
+}
+
+void replay_transport::_arm() {
+  struct itimerspec timer = {};
+  if (!m_due.empty()) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  m_due.front().due.time_since_epoch())
+                  .count();
+    timer.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+    timer.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+  }
+  timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &timer, nullptr);
+}
+
+ssize_t replay_transport::read(std::byte *data, size_t length) {
+  uint64_t expirations;
+  if (::read(m_timer, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    return -1;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  size_t copied = 0;
+  while (copied < length && !m_due.empty() && m_due.front().due <= now) {
+    std::vector<std::byte> &chunk = m_due.front().data;
+    size_t n = std::min(length - copied, chunk.size());
+    std::copy(chunk.begin(), chunk.begin() + n, data + copied);
+    chunk.erase(chunk.begin(), chunk.begin() + n);
+    copied += n;
+    if (chunk.empty()) {
+      m_due.pop_front();
+    }
+  }
+  _arm();
+  if (copied == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return static_cast<ssize_t>(copied);
+}
+
+ssize_t replay_transport::writev(const struct iovec *iov, int count) {
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    auto *base = static_cast<const std::byte *>(iov[i].iov_base);
+    for (size_t b = 0; b < iov[i].iov_len; b++, total++) {
+      size_t pos = m_tx_written + total;
+      if (pos >= m_tx.size() || m_tx[pos] != base[b]) {
+        m_tx_diverged++;
+      }
+    }
+  }
+  m_tx_written += total;
+  _schedule();
+  _arm();
+  return static_cast<ssize_t>(total);
+}
+
+size_t replay_transport::bytes_available() {
+  auto now = std::chrono::steady_clock::now();
+  size_t bytes = 0;
+  for (auto &chunk : m_due) {
+    if (chunk.due > now) {
+      break;
+    }
+    bytes += chunk.data.size();
+  }
+  return bytes;
+}
+
+void replay_transport::drain() {
+  auto now = std::chrono::steady_clock::now();
+  while (!m_due.empty() && m_due.front().due <= now) {
+    m_due.pop_front();
+  }
+  _arm();
+}
+
+bool replay_transport::set_line(const serif_line_t & /*line*/) {
+  return true;
+}
+
+// Line changes leave no trace in the session, there is nothing to replay
+bool replay_transport::set_modem_lines(unsigned int /*set*/,
+                                       unsigned int /*clear*/) {
+  return true;
+}
+
+size_t replay_transport::default_window() { return 1; }
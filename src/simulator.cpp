@@ -0,0 +1,199 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstring>
+
+#include "commands.hpp"
+#include "simulator.hpp"
+
+// Linux headers
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Start, eight data and two stop bits per byte on the wire
+constexpr unsigned int bits_per_byte = 11;
+// A partial command older than this is dropped like a UART idle timeout
+constexpr auto frame_timeout = std::chrono::milliseconds(50);
+
+simulator::simulator(const simulator_config_t &config, log_t log)
+    : m_config(config), m_log(log), m_device(config.timing, log),
+      m_rng(config.seed), m_bit_error(config.bit_error_rate) {}
+
+simulator::~simulator() {
+  stop();
+  for (int fd : {m_master, m_slave, m_wakeup}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+const std::string &simulator::port() { return m_port; }
+
+zw500 &simulator::device() { return m_device; }
+
+simulator_stats_t simulator::stats() { return {m_commands, m_bit_errors}; }
+
+bool simulator::start() {
+  m_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (m_master < 0 || grantpt(m_master) != 0 || unlockpt(m_master) != 0) {
+    m_log->error() << "Failed to create pseudo terminal" << std::endl;
+    return false;
+  }
+  m_port = ptsname(m_master);
+
+  // Holding the slave open keeps the master readable between zft runs
+  m_slave = ::open(m_port.c_str(), O_RDWR | O_NOCTTY);
+  if (m_slave < 0) {
+    m_log->error() << "Failed to open " << m_port << std::endl;
+    return false;
+  }
+  struct termios tty;
+  tcgetattr(m_slave, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(m_slave, TCSANOW, &tty);
+
+  fcntl(m_master, F_SETFL, fcntl(m_master, F_GETFL) | O_NONBLOCK);
+  m_wakeup = eventfd(0, EFD_NONBLOCK);
+  m_running = true;
+  m_thread = std::thread(&simulator::_run, this);
+  m_log->info() << "Simulating Z-Wave 500 on " << m_port << std::endl;
+  return true;
+}
+
+void simulator::stop() {
+  if (!m_running.exchange(false)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(m_wakeup, &one, sizeof(one)) < 0) {
+    m_log->warn() << "Failed to wake simulator" << std::endl;
+  }
+  m_thread.join();
+}
+
+void simulator::_reply(const zw500::frame_t &cmd,
+                       zw500::clock::time_point now) {
+  reply_t reply;
+  m_device.execute(cmd, reply.data, now);
+  m_commands++;
+
+  for (auto &byte : reply.data) {
+    for (int bit = 0; bit < 8; bit++) {
+      if (m_bit_error(m_rng)) {
+        byte ^= static_cast<std::byte>(1 << bit);
+        m_bit_errors++;
+      }
+    }
+  }
+
+  // Replies leave after the command latency and queue up behind each other
+  // on the wire at the configured baud rate
+  reply.due = std::max(now + m_config.latency, m_wire_free);
+  if (m_config.baud) {
+    reply.due += std::chrono::microseconds(4 * bits_per_byte * 1000000 /
+                                           m_config.baud);
+  }
+  m_wire_free = reply.due;
+  m_replies.push_back(reply);
+}
+
+void simulator::_receive(const std::byte *data, size_t length,
+                         zw500::clock::time_point now) {
+  if (m_frame_fill && now - m_last_rx > frame_timeout) {
+    m_log->debug() << "Sim: dropping " << m_frame_fill
+                   << " bytes of a partial command" << std::endl;
+    m_frame_fill = 0;
+  }
+  m_last_rx = now;
+
+  const zw500::frame_t enable = {CMD_ENABLE_INTERFACE};
+  for (size_t i = 0; i < length; i++) {
+    if (m_device.enabled()) {
+      m_frame[m_frame_fill++] = data[i];
+      if (m_frame_fill == m_frame.size()) {
+        m_frame_fill = 0;
+        _reply(m_frame, now);
+      }
+      continue;
+    }
+
+    // Outside programming mode only the enable sequence is recognised,
+    // at any byte offset
+    std::memmove(&m_frame[0], &m_frame[1], m_frame.size() - 1);
+    m_frame[m_frame.size() - 1] = data[i];
+    if (m_frame == enable) {
+      m_frame.fill(std::byte{0});
+      _reply(enable, now);
+    }
+  }
+}
+
+void simulator::_send_due(zw500::clock::time_point now) {
+  std::byte out[4096];
+  size_t length = 0;
+  while (!m_replies.empty() && m_replies.front().due <= now &&
+         length + 4 <= sizeof(out)) {
+    std::memcpy(&out[length], m_replies.front().data.data(), 4);
+    length += 4;
+    m_replies.pop_front();
+  }
+  size_t sent = 0;
+  while (sent < length) {
+    ssize_t n = write(m_master, &out[sent], length - sent);
+    if (n < 0) {
+      struct pollfd pfd = {m_master, POLLOUT, 0};
+      poll(&pfd, 1, 10);
+      continue;
+    }
+    sent += static_cast<size_t>(n);
+  }
+}
+
+void simulator::_run() {
+  struct pollfd fds[2] = {{m_master, POLLIN, 0}, {m_wakeup, POLLIN, 0}};
+  std::byte data[4096];
+
+  while (m_running) {
+    struct timespec timeout;
+    struct timespec *ptimeout = nullptr;
+    if (!m_replies.empty()) {
+      auto wait = std::max(m_replies.front().due - zw500::clock::now(),
+                           zw500::clock::duration::zero());
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wait);
+      timeout.tv_sec = static_cast<time_t>(ns.count() / 1000000000);
+      timeout.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+      ptimeout = &timeout;
+    }
+    if (ppoll(fds, 2, ptimeout, nullptr) < 0) {
+      continue;
+    }
+
+    auto now = zw500::clock::now();
+    if (fds[0].revents & POLLIN) {
+      ssize_t n = read(m_master, data, sizeof(data));
+      if (n > 0) {
+        _receive(data, static_cast<size_t>(n), now);
+      }
+    }
+    _send_due(now);
+  }
+}
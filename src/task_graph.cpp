@@ -0,0 +1,186 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "task_graph.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iterator>
+
+using clock_type = std::chrono::steady_clock;
+
+static double _seconds(clock_type::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+task_graph::task_graph(log_t log) : m_log(log) {}
+
+void task_graph::add(const task_t &task) {
+  size_t index = m_nodes.size();
+  node_t node;
+  node.task = task;
+  for (const void *data : task.reads) {
+    auto writer = m_writer.find(data);
+    if (writer != m_writer.end()) {
+      node.deps.push_back(writer->second);
+    }
+    m_readers[data].push_back(index);
+  }
+  for (const void *data : task.writes) {
+    auto writer = m_writer.find(data);
+    if (writer != m_writer.end()) {
+      node.deps.push_back(writer->second);
+    }
+    auto &readers = m_readers[data];
+    std::copy_if(readers.begin(), readers.end(),
+                 std::back_inserter(node.deps),
+                 [index](size_t reader) { return reader != index; });
+    readers.clear();
+    m_writer[data] = index;
+  }
+  if (task.lane == TASK_DEVICE) {
+    if (m_last_device != SIZE_MAX) {
+      node.deps.push_back(m_last_device);
+    }
+    m_last_device = index;
+  }
+  std::sort(node.deps.begin(), node.deps.end());
+  node.deps.erase(std::unique(node.deps.begin(), node.deps.end()),
+                  node.deps.end());
+  m_nodes.push_back(node);
+}
+
+void task_graph::set_phase_hook(std::function<void()> hook) {
+  m_phase_hook = hook;
+}
+
+bool task_graph::_ready(const node_t &node) {
+  return !node.started &&
+         std::all_of(node.deps.begin(), node.deps.end(),
+                     [this](size_t dep) { return m_nodes[dep].done; });
+}
+
+// Called with m_mutex held
+void task_graph::_launch_ready() {
+  if (m_failed) {
+    return;
+  }
+  for (size_t i = 0; i < m_nodes.size(); i++) {
+    node_t &node = m_nodes[i];
+    if (node.task.lane == TASK_HOST && _ready(node)) {
+      node.started = true;
+      m_running++;
+      m_workers.emplace_back([this, i]() { _execute(i); });
+    }
+  }
+}
+
+void task_graph::_execute(size_t index) {
+  node_t &node = m_nodes[index];
+  bool host = node.task.lane == TASK_HOST;
+  if (host) {
+    m_log->begin_buffer();
+  }
+  auto start = clock_type::now();
+  bool ok = node.task.run();
+  auto end = clock_type::now();
+  if (host) {
+    m_log->end_buffer();
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  node.start = start;
+  node.end = end;
+  node.done = ok;
+  m_failed = m_failed || !ok;
+  m_running--;
+  m_done++;
+  // Successors of a host task need not wait for the device task running
+  // on the calling thread
+  if (host) {
+    _launch_ready();
+  }
+  m_cv.notify_all();
+}
+
+bool task_graph::run() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_start = clock_type::now();
+  size_t next = 0; // Device tasks are taken strictly in order
+  while (true) {
+    _launch_ready();
+    while (next < m_nodes.size() && (m_nodes[next].task.lane != TASK_DEVICE ||
+                                     m_nodes[next].started)) {
+      next++;
+    }
+    if (!m_failed && next < m_nodes.size() && _ready(m_nodes[next])) {
+      m_nodes[next].started = true;
+      m_running++;
+      lock.unlock();
+      if (m_phase_hook) {
+        m_phase_hook();
+      }
+      _execute(next);
+      lock.lock();
+      continue;
+    }
+    if (m_running == 0 && (m_failed || m_done == m_nodes.size())) {
+      break;
+    }
+    m_cv.wait(lock);
+  }
+  lock.unlock();
+  // Workers are only added while tasks run, none is left to add one now
+  for (auto &worker : m_workers) {
+    worker.join();
+  }
+  m_workers.clear();
+  return !m_failed;
+}
+
+void task_graph::report() {
+  clock_type::time_point end = m_start;
+  clock_type::duration device{0};
+  clock_type::duration host{0};
+  // Listed as they started, overlapping phases show up next to each other
+  std::vector<const node_t *> ran;
+  for (auto &node : m_nodes) {
+    if (node.end != clock_type::time_point()) {
+      ran.push_back(&node);
+    }
+  }
+  std::stable_sort(ran.begin(), ran.end(),
+                   [](const node_t *a, const node_t *b) {
+                     return a->start < b->start;
+                   });
+  for (const node_t *phase : ran) {
+    const node_t &node = *phase;
+    auto took = node.end - node.start;
+    (node.task.lane == TASK_DEVICE ? device : host) += took;
+    end = std::max(end, node.end);
+    m_log->info() << "Phase " << std::left << std::setw(20) << node.task.name
+                  << std::right << std::fixed << std::setprecision(3)
+                  << (node.task.lane == TASK_DEVICE ? " device" : " host  ")
+                  << " at " << std::setw(7) << _seconds(node.start - m_start)
+                  << " s, took " << std::setw(7) << _seconds(took) << " s"
+                  << (node.done ? "" : ", failed") << std::defaultfloat
+                  << std::endl;
+  }
+  m_log->msg() << "Wall time: " << std::fixed << std::setprecision(3)
+               << _seconds(end - m_start) << " s, device " << _seconds(device)
+               << " s, host " << _seconds(host) << " s" << std::defaultfloat
+               << std::endl;
+}
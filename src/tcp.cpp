@@ -0,0 +1,313 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tcp.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+// Linux headers
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Telnet (RFC 854) and COM port control (RFC 2217) codes
+constexpr unsigned char telnet_iac = 255;
+constexpr unsigned char telnet_dont = 254;
+constexpr unsigned char telnet_do = 253;
+constexpr unsigned char telnet_wont = 252;
+constexpr unsigned char telnet_will = 251;
+constexpr unsigned char telnet_sb = 250;
+constexpr unsigned char telnet_se = 240;
+constexpr unsigned char option_binary = 0;
+constexpr unsigned char option_sga = 3;
+constexpr unsigned char option_com_port = 44;
+constexpr unsigned char com_set_baudrate = 1;
+constexpr unsigned char com_set_datasize = 2;
+constexpr unsigned char com_set_parity = 3;
+constexpr unsigned char com_set_stopsize = 4;
+constexpr unsigned char com_set_control = 5;
+constexpr unsigned char com_purge_data = 12;
+
+// Every round trip crosses the network, so keep plenty of commands in flight
+constexpr size_t tcp_window = 32;
+
+tcp_transport::tcp_transport(const std::string &host, const std::string &port,
+                             bool rfc2217, log_t log)
+    : m_host(host), m_port(port), m_rfc2217(rfc2217), m_log(log) {}
+
+tcp_transport::~tcp_transport() {
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+bool tcp_transport::open(const serif_line_t &line) {
+  struct addrinfo hints = {};
+  struct addrinfo *result = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &result) != 0) {
+    m_log->error() << "Failed to resolve " << m_host << std::endl;
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (struct addrinfo *ai = result; ai != nullptr; ai = ai->ai_next) {
+    m_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (m_fd < 0) {
+      continue;
+    }
+    if (connect(m_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(m_fd);
+    m_fd = -1;
+  }
+  freeaddrinfo(result);
+  if (m_fd < 0) {
+    m_log->error() << "Failed to connect to " << m_host << ":" << m_port
+                   << std::endl;
+    return false;
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  m_log->info() << "Connected to " << m_host << ":" << m_port << " in "
+                << elapsed.count() << " ms" << std::endl;
+
+  // Commands are tiny and latency bound, never let Nagle hold them back
+  int one = 1;
+  setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+
+  if (!m_rfc2217) {
+    return true;
+  }
+
+  const unsigned char negotiate[] = {
+      telnet_iac, telnet_will, option_com_port, telnet_iac,
+      telnet_will, option_binary, telnet_iac, telnet_do,
+      option_binary, telnet_iac, telnet_will, option_sga,
+      telnet_iac, telnet_do, option_sga};
+  return _send(negotiate, sizeof(negotiate)) && set_line(line);
+}
+
+int tcp_transport::fd() { return m_fd; }
+
+bool tcp_transport::_send(const unsigned char *data, size_t length) {
+  while (length) {
+    ssize_t n = send(m_fd, data, length, MSG_NOSIGNAL);
+    if (n < 0) {
+      struct pollfd pfd = {m_fd, POLLOUT, 0};
+      if ((errno != EAGAIN && errno != EINTR) || poll(&pfd, 1, 1000) <= 0) {
+        return false;
+      }
+      continue;
+    }
+    data += n;
+    length -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool tcp_transport::_com_port(unsigned char cmd, const unsigned char *value,
+                              size_t length) {
+  std::vector<unsigned char> sb = {telnet_iac, telnet_sb, option_com_port,
+                                   cmd};
+  for (size_t i = 0; i < length; i++) {
+    sb.push_back(value[i]);
+    if (value[i] == telnet_iac) {
+      sb.push_back(telnet_iac);
+    }
+  }
+  sb.push_back(telnet_iac);
+  sb.push_back(telnet_se);
+  return _send(sb.data(), sb.size());
+}
+
+size_t tcp_transport::_parse(std::byte *data, size_t length) {
+  size_t out = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    switch (m_state) {
+    case TELNET_DATA:
+      if (c == telnet_iac) {
+        m_state = TELNET_IAC;
+      } else {
+        data[out++] = data[i];
+      }
+      break;
+    case TELNET_IAC:
+      if (c == telnet_iac) {
+        data[out++] = data[i];
+        m_state = TELNET_DATA;
+      } else if (c == telnet_sb) {
+        m_state = TELNET_SB;
+      } else if (c >= telnet_will && c <= telnet_dont) {
+        m_verb = c;
+        m_state = TELNET_OPTION;
+      } else {
+        m_state = TELNET_DATA;
+      }
+      break;
+    case TELNET_OPTION: {
+      // Refuse everything that was not asked for during open()
+      bool known = (c == option_binary || c == option_sga ||
+                    (c == option_com_port && m_verb == telnet_do));
+      if (!known && (m_verb == telnet_do || m_verb == telnet_will)) {
+        unsigned char refuse[] = {
+            telnet_iac,
+            static_cast<unsigned char>(m_verb == telnet_do ? telnet_wont
+                                                           : telnet_dont),
+            c};
+        _send(refuse, sizeof(refuse));
+      }
+      m_state = TELNET_DATA;
+      break;
+    }
+    case TELNET_SB:
+      // COM port option acknowledgements carry nothing we act on
+      if (c == telnet_iac) {
+        m_state = TELNET_SB_IAC;
+      }
+      break;
+    case TELNET_SB_IAC:
+      m_state = (c == telnet_se) ? TELNET_DATA : TELNET_SB;
+      break;
+    }
+  }
+  return out;
+}
+
+ssize_t tcp_transport::_recv(std::byte *data, size_t length) {
+  ssize_t n = recv(m_fd, data, length, 0);
+  if (n == 0) {
+    m_log->error() << "Connection closed by " << m_host << std::endl;
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (n < 0 || !m_rfc2217) {
+    return n;
+  }
+  size_t out = _parse(data, static_cast<size_t>(n));
+  if (out == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return static_cast<ssize_t>(out);
+}
+
+ssize_t tcp_transport::read(std::byte *data, size_t length) {
+  // Data parsed ahead by bytes_available() goes first
+  if (!m_rx.empty()) {
+    size_t n = std::min(length, m_rx.size());
+    std::copy(m_rx.begin(), m_rx.begin() + n, data);
+    m_rx.erase(m_rx.begin(), m_rx.begin() + n);
+    return static_cast<ssize_t>(n);
+  }
+  return _recv(data, length);
+}
+
+ssize_t tcp_transport::writev(const struct iovec *iov, int count) {
+  if (!m_rfc2217) {
+    // writev() would raise SIGPIPE when the server has gone away
+    struct msghdr msg = {};
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = static_cast<size_t>(count);
+    return sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+  }
+
+  // 0xFF has to be doubled in the Telnet stream, so the escaped copy is
+  // always sent completely to keep byte counts in terms of the caller's data
+  size_t total = 0;
+  m_tx.clear();
+  for (int i = 0; i < count; i++) {
+    auto *base = static_cast<const unsigned char *>(iov[i].iov_base);
+    for (size_t b = 0; b < iov[i].iov_len; b++) {
+      m_tx.push_back(base[b]);
+      if (base[b] == telnet_iac) {
+        m_tx.push_back(telnet_iac);
+      }
+    }
+    total += iov[i].iov_len;
+  }
+  if (!_send(m_tx.data(), m_tx.size())) {
+    return -1;
+  }
+  return static_cast<ssize_t>(total);
+}
+
+size_t tcp_transport::bytes_available() {
+  if (!m_rfc2217) {
+    int bytes = 0;
+    ioctl(m_fd, FIONREAD, &bytes);
+    return static_cast<size_t>(bytes);
+  }
+
+  // Telnet control sequences are not payload, so parse what has arrived
+  std::byte data[256];
+  int bytes = 0;
+  while (ioctl(m_fd, FIONREAD, &bytes) == 0 && bytes > 0) {
+    ssize_t n = _recv(data, sizeof(data));
+    if (n > 0) {
+      m_rx.insert(m_rx.end(), data, data + n);
+    } else if (errno != EAGAIN) {
+      break;
+    }
+  }
+  return m_rx.size();
+}
+
+void tcp_transport::drain() {
+  if (m_rfc2217) {
+    const unsigned char purge_rx = 1;
+    _com_port(com_purge_data, &purge_rx, 1);
+  }
+  m_rx.clear();
+  std::byte data[256];
+  while (recv(m_fd, data, sizeof(data), 0) > 0) {
+  }
+}
+
+bool tcp_transport::set_line(const serif_line_t &line) {
+  if (!m_rfc2217) {
+    m_log->info() << "Line settings of " << m_host
+                  << " are configured on the server" << std::endl;
+    return true;
+  }
+  const unsigned char baud[] = {static_cast<unsigned char>(line.baud >> 24),
+                                static_cast<unsigned char>(line.baud >> 16),
+                                static_cast<unsigned char>(line.baud >> 8),
+                                static_cast<unsigned char>(line.baud)};
+  const unsigned char datasize = 8;
+  const unsigned char parity = 1; // NONE
+  const unsigned char stopsize = static_cast<unsigned char>(line.stop_bits);
+  const unsigned char control = line.rtscts ? 3 : 1; // HW or no flow control
+  return _com_port(com_set_baudrate, baud, sizeof(baud)) &&
+         _com_port(com_set_datasize, &datasize, 1) &&
+         _com_port(com_set_parity, &parity, 1) &&
+         _com_port(com_set_stopsize, &stopsize, 1) &&
+         _com_port(com_set_control, &control, 1);
+}
+
+size_t tcp_transport::default_window() { return tcp_window; }
@@ -0,0 +1,45 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "transport.hpp"
+#include "tcp.hpp"
+#include "tty.hpp"
+
+std::unique_ptr<transport> make_transport(const std::string &if_name,
+                                          log_t log) {
+  const struct {
+    const char *scheme;
+    bool rfc2217;
+  } schemes[] = {{"tcp://", false}, {"rfc2217://", true}};
+
+  for (auto &scheme : schemes) {
+    std::string prefix(scheme.scheme);
+    if (if_name.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    std::string address = if_name.substr(prefix.size());
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+      log->error() << "Missing port in " << if_name << std::endl;
+      return nullptr;
+    }
+    return std::make_unique<tcp_transport>(address.substr(0, colon),
+                                           address.substr(colon + 1),
+                                           scheme.rfc2217, log);
+  }
+  return std::make_unique<tty_transport>(if_name, log);
+}
@@ -0,0 +1,314 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tty.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// Linux headers
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+tty_transport::tty_transport(const std::string &if_name, log_t log)
+    : m_if_name(if_name), m_log(log) {}
+
+tty_transport::~tty_transport() {
+  if (m_fd >= 0) {
+    _restore_low_latency();
+    close(m_fd);
+  }
+}
+
+bool tty_transport::open(const serif_line_t &line) {
+  m_log->debug() << "Opening port " << m_if_name << std::endl;
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+  m_fd = ::open(m_if_name.c_str(), O_RDWR | O_NOCTTY);
+  if (m_fd < 0) {
+    m_log->error() << "Failed to open " << m_if_name << ": "
+                   << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct termios tty;
+
+  if (tcgetattr(m_fd, &tty) != 0) {
+    m_log->error() << "Failed to read settings " << m_if_name << std::endl;
+    ::close(m_fd);
+    m_fd = -1;
+    return false;
+  }
+
+  tty.c_cflag &= ~PARENB; // No parity
+  tty.c_cflag &= ~CSIZE;  // Clear all the size bits
+  tty.c_cflag |= CS8;     // 8 bits per byte (most common)
+
+  tty.c_lflag &= ~ICANON; // Disable canonical mode
+  tty.c_lflag &= ~ECHO;   // Disable echo
+  tty.c_lflag &= ~ECHOE;  // Disable erasure
+  tty.c_lflag &= ~ECHONL; // Disable new-line echo
+  tty.c_lflag &= ~ISIG;   // Disable interpretation of INTR, QUIT and SUSP
+
+  tty.c_iflag &= ~(IXON | IXOFF | IXANY); // No sw flow ctrl
+  tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+                   ICRNL); // No special handling of received bytes
+  tty.c_iflag |= IGNPAR;   // Ignore framing errors
+
+  tty.c_oflag &= ~OPOST; // No interpretation of output bytes
+  tty.c_oflag &= ~ONLCR; // No conv. of newline to carriage return/line feed
+
+  tty.c_cc[VTIME] = 0; // Never block in read(), deadlines are handled by
+  tty.c_cc[VMIN] = 0;  // poll() with the timeout given in 1/10 s
+
+  if (!_set_line(tty, line)) {
+    ::close(m_fd);
+    m_fd = -1;
+    return false;
+  }
+
+  if (tcsetattr(m_fd, TCSANOW, &tty) != 0) {
+    m_log->error() << "Error " << std::dec << errno << " from tcsetattr"
+                   << std::endl;
+    ::close(m_fd);
+    m_fd = -1;
+    return false;
+  }
+  m_log->debug() << "Port open :-)" << std::endl;
+  return true;
+}
+
+bool tty_transport::_set_line(struct termios &tty,
+                              const serif_line_t &line) {
+  static const struct {
+    unsigned int baud;
+    speed_t speed;
+  } speeds[] = {{9600, B9600},     {19200, B19200},     {38400, B38400},
+                {57600, B57600},   {115200, B115200},   {230400, B230400},
+                {460800, B460800}, {500000, B500000},   {576000, B576000},
+                {921600, B921600}, {1000000, B1000000}, {1500000, B1500000},
+                {2000000, B2000000}};
+
+  auto it = std::find_if(std::begin(speeds), std::end(speeds),
+                         [&line](auto &s) { return s.baud == line.baud; });
+  if (it == std::end(speeds)) {
+    m_log->error() << "Unsupported baud rate " << std::dec << line.baud
+                   << std::endl;
+    return false;
+  }
+  cfsetspeed(&tty, it->speed);
+
+  if (line.stop_bits == 2) {
+    tty.c_cflag |= CSTOPB;
+  } else {
+    tty.c_cflag &= ~CSTOPB;
+  }
+
+  if (line.rtscts) {
+    tty.c_cflag |= CRTSCTS;
+  } else {
+    tty.c_cflag &= ~CRTSCTS;
+  }
+  return true;
+}
+
+bool tty_transport::present() {
+  return ::access(m_if_name.c_str(), F_OK) == 0;
+}
+
+bool tty_transport::wait_present(
+    std::chrono::steady_clock::time_point deadline) {
+  if (present()) {
+    return true;
+  }
+  m_log->msg() << "Waiting for " << m_if_name << std::endl;
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    m_log->error() << "inotify: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  // Watch the deepest directory of the path that exists, /dev/serial/by-id
+  // only appears with the first adapter. The watch is set before looking
+  // again, so a node created in between is not missed.
+  std::string watched;
+  int watch = -1;
+  bool found = false;
+  while (!(found = present())) {
+    std::string dir = m_if_name;
+    do {
+      std::vector<char> path(dir.begin(), dir.end());
+      path.push_back('\0');
+      dir = dirname(path.data());
+    } while (dir.size() > 1 && ::access(dir.c_str(), F_OK) != 0);
+    if (dir != watched) {
+      if (watch >= 0) {
+        inotify_rm_watch(fd, watch);
+      }
+      watch = inotify_add_watch(fd, dir.c_str(),
+                                IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+      watched = dir;
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      break;
+    }
+    // Looks again at least once a second should an event be missed
+    auto remaining =
+        std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    poll(&pfd, 1, static_cast<int>(std::min<long>(remaining.count(), 1000)));
+    char events[4096];
+    while (::read(fd, events, sizeof(events)) > 0) {
+    }
+  }
+  ::close(fd);
+  return found;
+}
+
+bool tty_transport::set_line(const serif_line_t &line) {
+  struct termios tty;
+  if (tcgetattr(m_fd, &tty) != 0 || !_set_line(tty, line) ||
+      tcsetattr(m_fd, TCSADRAIN, &tty) != 0) {
+    m_log->error() << "Failed to apply line settings to " << m_if_name
+                   << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool tty_transport::set_modem_lines(unsigned int set, unsigned int clear) {
+  // Both lines change with one TIOCMSET so they switch together
+  int bits;
+  if (ioctl(m_fd, TIOCMGET, &bits) != 0) {
+    m_log->warn() << "Modem lines of " << m_if_name << " not readable ("
+                  << strerror(errno) << ")" << std::endl;
+    return false;
+  }
+  auto apply = [&bits, set, clear](unsigned int line, int tiocm) {
+    if (set & line) {
+      bits |= tiocm;
+    } else if (clear & line) {
+      bits &= ~tiocm;
+    }
+  };
+  apply(SERIF_LINE_DTR, TIOCM_DTR);
+  apply(SERIF_LINE_RTS, TIOCM_RTS);
+  if (ioctl(m_fd, TIOCMSET, &bits) != 0) {
+    m_log->warn() << "Modem lines of " << m_if_name << " not settable ("
+                  << strerror(errno) << ")" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void tty_transport::set_low_latency(bool enable) {
+  enable ? _apply_low_latency() : _restore_low_latency();
+}
+
+void tty_transport::_apply_low_latency() {
+  struct serial_struct serial;
+  if (ioctl(m_fd, TIOCGSERIAL, &serial) != 0) {
+    m_log->info() << "Low latency: ASYNC_LOW_LATENCY not supported ("
+                  << strerror(errno) << ")" << std::endl;
+  } else if (serial.flags & ASYNC_LOW_LATENCY) {
+    m_log->info() << "Low latency: ASYNC_LOW_LATENCY already set" << std::endl;
+  } else {
+    int flags = serial.flags;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(m_fd, TIOCSSERIAL, &serial) != 0) {
+      m_log->info() << "Low latency: ASYNC_LOW_LATENCY not applied ("
+                    << strerror(errno) << ")" << std::endl;
+    } else {
+      m_serial_flags = flags;
+      m_log->info() << "Low latency: ASYNC_LOW_LATENCY applied" << std::endl;
+    }
+  }
+
+  // USB-serial adapters like the FTDI ones buffer small packets for up to
+  // latency_timer ms before handing them to the host
+  char path[PATH_MAX];
+  if (realpath(m_if_name.c_str(), path) == nullptr) {
+    return;
+  }
+  std::string timer =
+      std::string("/sys/class/tty/") + basename(path) + "/device/latency_timer";
+  std::ifstream in(timer);
+  std::string orig;
+  if (!(in >> orig)) {
+    m_log->info() << "Low latency: no latency_timer for " << m_if_name
+                  << std::endl;
+    return;
+  }
+  std::ofstream out(timer);
+  if (!(out << "1" << std::endl)) {
+    m_log->info() << "Low latency: latency_timer not writable, stays at "
+                  << orig << " ms" << std::endl;
+    return;
+  }
+  m_latency_timer = timer;
+  m_latency_timer_orig = orig;
+  m_log->info() << "Low latency: latency_timer " << orig << " -> 1 ms"
+                << std::endl;
+}
+
+void tty_transport::_restore_low_latency() {
+  if (m_serial_flags >= 0) {
+    struct serial_struct serial;
+    if (ioctl(m_fd, TIOCGSERIAL, &serial) == 0) {
+      serial.flags = m_serial_flags;
+      ioctl(m_fd, TIOCSSERIAL, &serial);
+    }
+    m_serial_flags = -1;
+  }
+  if (!m_latency_timer.empty()) {
+    std::ofstream out(m_latency_timer);
+    out << m_latency_timer_orig << std::endl;
+    m_latency_timer.clear();
+  }
+}
+
+int tty_transport::fd() { return m_fd; }
+
+ssize_t tty_transport::read(std::byte *data, size_t length) {
+  return ::read(m_fd, data, length);
+}
+
+ssize_t tty_transport::writev(const struct iovec *iov, int count) {
+  return ::writev(m_fd, iov, count);
+}
+
+size_t tty_transport::bytes_available() {
+  int bytes = 0;
+  ioctl(m_fd, FIONREAD, &bytes);
+  return static_cast<size_t>(bytes);
+}
+
+void tty_transport::drain() { tcflush(m_fd, TCIFLUSH); }
@@ -15,19 +15,26 @@
 // You should have received a copy of the GNU General Public License
 // along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <thread>
 #include <vector>
 
+#include <getopt.h>
 #include <pthread.h>
 #include <unistd.h>
 
+#include "file.hpp"
 #include "flasher.hpp"
+#include "journal.hpp"
 #include "logger.hpp"
 #include "nvr.hpp"
+#include "task_graph.hpp"
 
 struct {
   char *device = nullptr;
@@ -37,27 +44,217 @@ struct {
   char *nvr_of = nullptr;
   char *nvr_p_if = nullptr;
   char *nvr_p_of = nullptr;
-  unsigned char timeout = 1;
+  unsigned char timeout = 10;
+  size_t window = 0;
+  bool low_latency = false;
+  serif_line_t line;
+  std::vector<unsigned int> probe;
+  char *record = nullptr;
+  char *replay = nullptr;
+  bool replay_fast = false;
+  bool skip_identical = false;
+  bool diff = false;
+  char *baseline = nullptr;
+  verify_policy_t verify = VERIFY_FULL;
+  unsigned int coverage = 25;
+  bool verify_all = false;
+  size_t first_sector = 0;
+  size_t sector_count = FLASH_SECTORS;
+  char *journal = nullptr;
+  unsigned int budget = 0;
+  char *nvr_cache = nullptr;
+  unsigned int connect_timeout = 60;
+  std::vector<serif_line_step_t> enter_lines;
+  std::vector<serif_line_step_t> release_lines;
   bool erase = false;
   bool reset = false;
   bool update_s2 = false;
   logger::log_level_t level = logger::LOG_ERROR;
 } args;
 
+enum long_option_id {
+  OPT_STOPBITS = 256,
+  OPT_RTSCTS,
+  OPT_PROBE,
+  OPT_RECORD,
+  OPT_REPLAY,
+  OPT_REPLAY_FAST,
+  OPT_SKIP_IDENTICAL,
+  OPT_DIFF,
+  OPT_BASELINE,
+  OPT_VERIFY,
+  OPT_VERIFY_ALL,
+  OPT_SECTORS,
+  OPT_REGION,
+  OPT_JOURNAL,
+  OPT_BUDGET,
+  OPT_NVR_CACHE,
+  OPT_CONNECT_TIMEOUT,
+  OPT_ENTER_LINES,
+  OPT_RELEASE_LINES
+};
+
+const struct option long_options[] = {
+    {"baud", required_argument, nullptr, 'b'},
+    {"stopbits", required_argument, nullptr, OPT_STOPBITS},
+    {"rtscts", no_argument, nullptr, OPT_RTSCTS},
+    {"probe", required_argument, nullptr, OPT_PROBE},
+    {"record", required_argument, nullptr, OPT_RECORD},
+    {"replay", required_argument, nullptr, OPT_REPLAY},
+    {"replay-fast", required_argument, nullptr, OPT_REPLAY_FAST},
+    {"skip-identical", no_argument, nullptr, OPT_SKIP_IDENTICAL},
+    {"diff", no_argument, nullptr, OPT_DIFF},
+    {"baseline", required_argument, nullptr, OPT_BASELINE},
+    {"verify", required_argument, nullptr, OPT_VERIFY},
+    {"verify-all", no_argument, nullptr, OPT_VERIFY_ALL},
+    {"sectors", required_argument, nullptr, OPT_SECTORS},
+    {"region", required_argument, nullptr, OPT_REGION},
+    {"journal", required_argument, nullptr, OPT_JOURNAL},
+    {"budget", required_argument, nullptr, OPT_BUDGET},
+    {"nvr-cache", required_argument, nullptr, OPT_NVR_CACHE},
+    {"connect-timeout", required_argument, nullptr, OPT_CONNECT_TIMEOUT},
+    {"enter-lines", required_argument, nullptr, OPT_ENTER_LINES},
+    {"release-lines", required_argument, nullptr, OPT_RELEASE_LINES},
+    {nullptr, 0, nullptr, 0}};
+
+std::vector<unsigned int> parse_list(const char *list) {
+  std::vector<unsigned int> values;
+  std::string entry;
+  std::istringstream ss(list);
+  while (std::getline(ss, entry, ',')) {
+    values.push_back(static_cast<unsigned int>(atoi(entry.c_str())));
+  }
+  return values;
+}
+
+bool parse_verify(const char *policy) {
+  std::string name(policy);
+  std::string::size_type colon = name.find(':');
+  if (colon != std::string::npos) {
+    args.coverage = static_cast<unsigned int>(atoi(&policy[colon + 1]));
+    name.resize(colon);
+  }
+  if (name == "full") {
+    args.verify = VERIFY_FULL;
+  } else if (name == "written") {
+    args.verify = VERIFY_WRITTEN;
+  } else if (name == "sampled") {
+    args.verify = VERIFY_SAMPLED;
+  } else if (name == "crc") {
+    args.verify = VERIFY_CRC;
+  } else {
+    return false;
+  }
+  return args.coverage > 0 && args.coverage <= 100;
+}
+
+// "A..B" or "A", inclusive, decimal or 0x prefixed hex. Addresses are
+// widened to whole sectors.
+bool parse_range(log_t log, const char *range, size_t unit) {
+  char *end = nullptr;
+  unsigned long first = strtoul(range, &end, 0);
+  unsigned long last = first;
+  if (end != range && strncmp(end, "..", 2) == 0) {
+    const char *second = end + 2;
+    last = strtoul(second, &end, 0);
+    if (end == second) {
+      return false;
+    }
+  }
+  if (end == range || *end != '\0' || last < first ||
+      last >= FLASH_SECTORS * unit) {
+    return false;
+  }
+  if (first % unit != 0 || (last + 1) % unit != 0) {
+    log->warn() << "Region " << range << " widened to whole sectors"
+                << std::endl;
+  }
+  args.first_sector = first / unit;
+  args.sector_count = last / unit - first / unit + 1;
+  return true;
+}
+
+// "dtr+,rts-,50,dtr-,20": dtr or rts with + to assert and - to release,
+// a number holds the lines for that many ms. Changes up to the next hold
+// are applied together.
+bool parse_lines(const char *list, std::vector<serif_line_step_t> &steps) {
+  static const struct {
+    const char *name;
+    unsigned int line;
+  } lines[] = {{"dtr", SERIF_LINE_DTR}, {"rts", SERIF_LINE_RTS}};
+  std::string entry;
+  std::istringstream ss(list);
+  serif_line_step_t step;
+  steps.clear();
+  while (std::getline(ss, entry, ',')) {
+    char *end = nullptr;
+    unsigned long hold = strtoul(entry.c_str(), &end, 10);
+    if (!entry.empty() && *end == '\0') {
+      step.hold = std::chrono::milliseconds(hold);
+      steps.push_back(step);
+      step = serif_line_step_t();
+      continue;
+    }
+    auto it = std::find_if(std::begin(lines), std::end(lines),
+                           [&entry](auto &l) {
+                             return entry.size() == 4 &&
+                                    entry.compare(0, 3, l.name) == 0;
+                           });
+    if (it == std::end(lines) || (entry[3] != '+' && entry[3] != '-')) {
+      return false;
+    }
+    if (entry[3] == '+') {
+      step.set |= it->line;
+      step.clear &= ~it->line;
+    } else {
+      step.clear |= it->line;
+      step.set &= ~it->line;
+    }
+  }
+  if (step.set | step.clear) {
+    steps.push_back(step);
+  }
+  return !steps.empty();
+}
+
 void evaluate_args(log_t log) {
-  if (args.device == nullptr) {
+  if (args.device == nullptr && args.replay == nullptr) {
     log->msg() << "Please specify device with -d" << std::endl;
     exit(-1);
   }
+  if (args.skip_identical && args.erase) {
+    log->warn() << "Erase requested, ignoring --skip-identical" << std::endl;
+    args.skip_identical = false;
+  }
+  if (args.diff && args.erase) {
+    log->warn() << "Erase requested, ignoring --diff" << std::endl;
+    args.diff = false;
+  }
+  bool region = args.sector_count != FLASH_SECTORS;
+  if (region && args.flash_if && (args.erase || args.diff)) {
+    log->warn() << "Erase or differential flashing requested, writing the "
+                   "whole image"
+                << std::endl;
+    args.first_sector = 0;
+    args.sector_count = FLASH_SECTORS;
+  }
+  region = args.sector_count != FLASH_SECTORS;
+  if (args.journal && (!args.flash_if || args.diff || region)) {
+    log->warn() << "Journal only covers full flash jobs, ignoring --journal"
+                << std::endl;
+    args.journal = nullptr;
+  }
 }
 
 void print_help(char *exec_name, log_t log) {
   log->msg() << "Usage: " << exec_name
              << " -d <device> -f <file> -o <file> -n <file> -m <file> -p "
                 "<file> -j <file> -e -s -t "
-                "<timeout> -v <level>"
+                "<timeout> -w <depth> -l -b <baud> -v <level>"
+             << std::endl
+             << "        -d <device>    Serial device, tcp:// or "
+                "rfc2217://host:port"
              << std::endl
-             << "        -d <device>    Serial device" << std::endl
              << "        -f <file>      Input hex file" << std::endl
              << "        -o <file>      Output hex file" << std::endl
              << "        -n <file>      Input NVR file" << std::endl
@@ -68,7 +265,63 @@ void print_help(char *exec_name, log_t log) {
              << std::endl
              << "        -s             Update NVR with S2 keypair" << std::endl
              << "        -e             Erase flash" << std::endl
-             << "        -t <timeout>   Serial receive timeout" << std::endl
+             << "        -t <timeout>   Serial timeout (1/10 s, 0 = off)"
+             << std::endl
+             << "        -w <depth>     Commands in flight (0 = auto, 1 = off)"
+             << std::endl
+             << "        -l             Low latency USB-serial profile"
+             << std::endl
+             << "        -b <baud>      Baud rate (default 115200)" << std::endl
+             << "        --stopbits <n> Stop bits 1 or 2 (default 2)"
+             << std::endl
+             << "        --rtscts       RTS/CTS flow control" << std::endl
+             << "        --probe <list> Try comma separated baud rates, "
+                "fastest first"
+             << std::endl
+             << "        --record <file>      Record the session to file"
+             << std::endl
+             << "        --replay <file>      Replay a recorded session"
+             << std::endl
+             << "        --replay-fast <file> Replay at maximum speed"
+             << std::endl
+             << "        --skip-identical     Skip flashing if the chip "
+                "already holds the image"
+             << std::endl
+             << "        --diff               Only flash sectors that differ "
+                "from a readback"
+             << std::endl
+             << "        --baseline <file>    Only flash sectors that differ "
+                "from this image"
+             << std::endl
+             << "        --verify <policy>    full, written, "
+                "sampled[:<percent>] or crc"
+             << std::endl
+             << "        --verify-all         Report all mismatches instead "
+                "of stopping at the first"
+             << std::endl
+             << "        --sectors <A..B>     Read or write only sectors A to B"
+             << std::endl
+             << "        --region <A..B>      Read or write only addresses A "
+                "to B"
+             << std::endl
+             << "        --journal <file>     Resume an interrupted flash job"
+             << std::endl
+             << "        --budget <s>         Time limit per phase (0 = off)"
+             << std::endl
+             << "        --nvr-cache <dir>    Reuse NVR copies of known chips"
+             << std::endl
+             << "        --connect-timeout <s>" << std::endl
+             << "                             Give up waiting for the device "
+                "(default 60, 0 = never)"
+             << std::endl
+             << "        --enter-lines <steps>" << std::endl
+             << "                             Modem lines that put the chip in "
+                "programming mode"
+             << std::endl
+             << "        --release-lines <steps>" << std::endl
+             << "                             Modem lines that let the chip "
+                "run, resets it at the end"
+             << std::endl
              << "        -v <level>     Log level 0..4" << std::endl;
 }
 
@@ -85,51 +338,48 @@ bool evaluate_call(log_t log, std::string call, std::string fail,
 bool dump_generic(log_t log, std::string call, std::vector<std::byte> &buffer,
                   char *filename) {
   log->msg() << call << filename << std::endl;
-  std::ofstream fs;
-  fs.open(filename, std::ios::binary);
-  for (size_t i = 0; i < buffer.size(); i++) {
-    char value = static_cast<char>(buffer[i]);
-    fs.write(&value, 1);
-  }
-  fs.close();
-  return true;
+  return file::dump(log, filename, buffer);
 }
 
 bool connect(log_t log, flasher &zft) {
-  bool connected = false;
-  while (!connected) {
-    connected = zft.connect(args.timeout);
-    if (!connected) {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+  // A missing device node is waited for with inotify, a device that does
+  // not answer yet is tried again after a short, growing pause
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  auto deadline = args.connect_timeout
+                      ? start + std::chrono::seconds(args.connect_timeout)
+                      : clock::time_point::max();
+  std::chrono::milliseconds pause{10};
+  while (true) {
+    if (zft.wait_for_device(deadline)) {
+      bool connected = args.probe.empty()
+                           ? zft.connect(args.timeout)
+                           : zft.probe(args.timeout, args.probe);
+      if (connected) {
+        log->msg() << "Connected after " << std::fixed
+                   << std::setprecision(3)
+                   << std::chrono::duration<double>(clock::now() - start)
+                          .count()
+                   << " s" << std::defaultfloat << std::endl;
+        return true;
+      }
     }
+    auto now = clock::now();
+    if (now >= deadline) {
+      log->error() << "No device answered within " << std::dec
+                   << args.connect_timeout << " s" << std::endl;
+      return false;
+    }
+    std::this_thread::sleep_for(
+        std::min<clock::duration>(pause, deadline - now));
+    pause = std::min(pause * 2, std::chrono::milliseconds(200));
   }
-  return true;
 }
 
 bool read_in_file(log_t log, const char *file,
                   std::vector<std::byte> &out_vector) {
   log->msg() << "Reading input file: " << file << std::endl;
-  std::ifstream fs;
-  fs.open(file, std::ios::binary);
-  if (!fs) {
-    log->error() << "Failed to open " << file << std::endl;
-    return false;
-  }
-
-  fs.seekg(0, fs.end);
-  int length = fs.tellg();
-  fs.seekg(0, fs.beg);
-
-  std::vector<char> temp_file_buffer;
-
-  temp_file_buffer.resize(length);
-  out_vector.reserve(length);
-  fs.read(temp_file_buffer.data(), length);
-
-  std::transform(temp_file_buffer.begin(), temp_file_buffer.end(),
-                 std::back_insert_iterator(out_vector),
-                 [](char in) { return static_cast<std::byte>(in); });
-  return true;
+  return file::load(log, file, out_vector);
 }
 
 bool read_nvr(log_t log, flasher &zft, std::vector<std::byte> &nvr) {
@@ -203,9 +453,26 @@ bool erase_flash(log_t log, flasher &zft) {
   return evaluate_call(log, "Erasing flash", "Failed erase", cmd);
 }
 
-bool write_flash(log_t log, flasher &zft, std::vector<std::byte> &flash) {
+bool write_flash(log_t log, flasher &zft, std::vector<std::byte> &flash,
+                 std::vector<std::byte> &baseline, journal &job) {
   log->msg() << "Flashing file" << std::endl;
-  if (zft.write_flash(flash, 0)) {
+  bool ok = false;
+  if (args.diff) {
+    ok = zft.write_flash_diff(flash, baseline);
+  } else if (job.resumed()) {
+    ok = zft.resume_flash(flash, job.next_sector());
+    // Kept, the journal would fail every later run the same way
+    if (ok && !zft.check_crc()) {
+      log->error() << "CRC check of the resumed image failed, dropping "
+                      "the journal"
+                   << std::endl;
+      job.discard();
+      ok = false;
+    }
+  } else {
+    ok = zft.write_flash(flash, args.first_sector, args.sector_count);
+  }
+  if (ok) {
     log->msg() << "Flashing done" << std::endl;
     return true;
   }
@@ -213,13 +480,51 @@ bool write_flash(log_t log, flasher &zft, std::vector<std::byte> &flash) {
   return false;
 }
 
+bool check_identical(log_t log, flasher &zft, std::vector<std::byte> &flash,
+                     bool &identical) {
+  log->msg() << "Checking if flash is up to date" << std::endl;
+  if (!zft.check_identical(flash, identical)) {
+    log->error() << "Checking flash failed" << std::endl;
+    return false;
+  }
+  if (identical) {
+    log->msg() << "Flash already up to date, skipping erase, write and verify"
+               << std::endl;
+  }
+  return true;
+}
+
+bool open_journal(log_t log, flasher &zft, journal &job,
+                  std::vector<std::byte> &flash, std::vector<std::byte> &nvr,
+                  std::vector<std::byte> &lockbits, bool &nvr_resumed) {
+  std::vector<std::byte> identity;
+  if (!zft.chip_identity(identity)) {
+    log->error() << "Reading the chip identity failed" << std::endl;
+    return false;
+  }
+  if (!job.open(args.journal, identity, flash)) {
+    return false;
+  }
+  nvr_resumed = job.resumed() && job.nvr_written(nvr, lockbits);
+  if (nvr_resumed) {
+    log->msg() << "NVR was written by the interrupted job, keeping it"
+               << std::endl;
+  }
+  zft.set_sector_hook([&job](size_t sector) { return job.sector(sector); });
+  return true;
+}
+
 bool read_flash(log_t log, flasher &zft, std::vector<std::byte> &flash) {
-  std::function<bool()> cmd = [&]() { return zft.read_flash(flash, 0); };
+  std::function<bool()> cmd = [&]() {
+    return zft.read_flash(flash, args.first_sector, args.sector_count);
+  };
   return evaluate_call(log, "Reading flash", "Reading flash failed", cmd);
 }
 
 bool verify_flash(log_t log, flasher &zft, std::vector<std::byte> &flash) {
-  std::function<bool()> cmd = [&]() { return zft.verify_flash(flash); };
+  std::function<bool()> cmd = [&]() {
+    return zft.verify_flash(flash, args.verify, args.coverage);
+  };
   return evaluate_call(log, "Verify flash", "Verify flash failed", cmd);
 }
 
@@ -231,6 +536,11 @@ bool dump_nvr(log_t log, std::vector<std::byte> &nvr, char *filename) {
   return dump_generic(log, "Writing NVR to ", nvr, filename);
 }
 
+bool reset_chip(log_t log, flasher &zft) {
+  std::function<bool()> cmd = [&]() { return zft.reset(); };
+  return evaluate_call(log, "Resetting chip", "Resetting chip failed", cmd);
+}
+
 int main(int argc, char **argv) {
   log_t log(new logger(logger::LOG_ERROR));
   std::vector<std::byte> nvr;
@@ -238,13 +548,17 @@ int main(int argc, char **argv) {
   std::vector<std::byte> lockbits;
   std::vector<std::byte> i_flash;
   std::vector<std::byte> o_flash;
+  std::vector<std::byte> baseline;
 
   int policy = SCHED_RR;
   struct sched_param param;
 
   bool connected = false;
+  bool identical = false;
+  bool nvr_resumed = false;
   int opt;
-  while ((opt = getopt(argc, argv, "d:f:o:n:m:p:j:est:v:rh?")) != -1) {
+  while ((opt = getopt_long(argc, argv, "d:f:o:n:m:p:j:est:w:lb:v:rh?",
+                            long_options, nullptr)) != -1) {
     switch (opt) {
     case 'd':
       args.device = optarg;
@@ -276,6 +590,80 @@ int main(int argc, char **argv) {
     case 't':
       args.timeout = static_cast<unsigned char>(atoi(optarg));
       break;
+    case 'w':
+      args.window = static_cast<size_t>(std::max(0, atoi(optarg)));
+      break;
+    case 'l':
+      args.low_latency = true;
+      break;
+    case 'b':
+      args.line.baud = static_cast<unsigned int>(atoi(optarg));
+      break;
+    case OPT_STOPBITS:
+      args.line.stop_bits = (atoi(optarg) == 1) ? 1 : 2;
+      break;
+    case OPT_RTSCTS:
+      args.line.rtscts = true;
+      break;
+    case OPT_PROBE:
+      args.probe = parse_list(optarg);
+      break;
+    case OPT_RECORD:
+      args.record = optarg;
+      break;
+    case OPT_REPLAY_FAST:
+      args.replay_fast = true;
+      // fall through
+    case OPT_REPLAY:
+      args.replay = optarg;
+      break;
+    case OPT_SKIP_IDENTICAL:
+      args.skip_identical = true;
+      break;
+    case OPT_BASELINE:
+      args.baseline = optarg;
+      // fall through
+    case OPT_DIFF:
+      args.diff = true;
+      break;
+    case OPT_VERIFY:
+      if (!parse_verify(optarg)) {
+        log->error() << "Unknown verify policy: " << optarg << std::endl;
+        exit(-1);
+      }
+      break;
+    case OPT_VERIFY_ALL:
+      args.verify_all = true;
+      break;
+    case OPT_SECTORS:
+    case OPT_REGION:
+      if (!parse_range(log, optarg,
+                       opt == OPT_SECTORS ? 1 : FLASH_SECTOR_SIZE)) {
+        log->error() << "Invalid range: " << optarg << std::endl;
+        exit(-1);
+      }
+      break;
+    case OPT_JOURNAL:
+      args.journal = optarg;
+      break;
+    case OPT_BUDGET:
+      args.budget = static_cast<unsigned int>(std::max(0, atoi(optarg)));
+      break;
+    case OPT_NVR_CACHE:
+      args.nvr_cache = optarg;
+      break;
+    case OPT_CONNECT_TIMEOUT:
+      args.connect_timeout =
+          static_cast<unsigned int>(std::max(0, atoi(optarg)));
+      break;
+    case OPT_ENTER_LINES:
+    case OPT_RELEASE_LINES:
+      if (!parse_lines(optarg, opt == OPT_ENTER_LINES ? args.enter_lines
+                                                      : args.release_lines)) {
+        log->error() << "Invalid line steps: " << optarg << std::endl;
+        exit(-1);
+      }
+      break;
     case 'v': {
       const int min = static_cast<int>(logger::LOG_QUIET);
       const int max = static_cast<int>(logger::LOG_DEBUG);
@@ -306,11 +694,31 @@ int main(int argc, char **argv) {
 
   log->set_log_level(args.level);
 
-  flasher zft(args.device, log);
+  flasher zft(args.replay ? args.replay : args.device, log);
+  if (args.record && !zft.record(args.record)) {
+    return 1;
+  }
+  if (args.replay && !zft.replay(args.replay, !args.replay_fast)) {
+    return 1;
+  }
+  zft.set_window(args.window);
+  zft.set_low_latency(args.low_latency);
+  zft.set_fail_fast(!args.verify_all);
+  zft.set_phase_budget(std::chrono::seconds(args.budget));
+  if (args.nvr_cache) {
+    zft.set_nvr_cache(args.nvr_cache);
+  }
+  zft.set_reset_lines(args.enter_lines, args.release_lines);
+  if (!zft.set_line(args.line)) {
+    return 1;
+  }
+
+  journal job(log);
 
   enum function_id {
     FUNC_CONNECT = 0,
     FUNC_READ_IN_FLASH,
+    FUNC_READ_IN_BASELINE,
     FUNC_READ_IN_NVR,
     FUNC_READ_IN_NVR_PRESET,
     FUNC_READ_NVR,
@@ -320,6 +728,7 @@ int main(int argc, char **argv) {
     FUNC_UPDATE_NVR_S2,
     FUNC_READ_LOCKBITS,
     FUNC_SET_LOCKBITS,
+    FUNC_CHECK_IDENTICAL,
     FUNC_ERASE_FLASH,
     FUNC_WRITE_FLASH,
     FUNC_READ_FLASH,
@@ -327,138 +736,280 @@ int main(int argc, char **argv) {
     FUNC_DUMP_FLASH,
     FUNC_DUMP_NVR,
     FUNC_EXPORT_NVR,
+    FUNC_OPEN_JOURNAL,
+    FUNC_JOURNAL_ERASE,
+    FUNC_JOURNAL_NVR,
+    FUNC_CLOSE_JOURNAL,
+    FUNC_RESET_CHIP,
     FUNC_MAX
   };
 
-  std::function<bool()> function_table[FUNC_MAX] = {
-      // FUNC_CONNECT
-      [log, &zft]() { return connect(log, zft); },
-      // FUNC_READ_IN_FLASH
-      [log, &i_flash]() { return read_in_file(log, args.flash_if, i_flash); },
-      // FUNC_READ_IN_NVR
-      [log, &nvr]() { return read_in_file(log, args.nvr_if, nvr); },
-      // FUNC_READ_IN_NVR_PRESET
-      [log, &preset]() { return read_in_file(log, args.nvr_p_if, preset); },
-      // FUNC_READ_NVR
-      [log, &zft, &nvr]() { return read_nvr(log, zft, nvr); },
-      // FUNC_SET_NVR
-      [log, &zft, &nvr]() { return set_nvr(log, zft, nvr); },
-      // FUNC_RESET_NVR
-      [log, &nvr]() { return reset_nvr(log, nvr); },
-      // FUNC_PRESET_NVR
-      [log, &nvr, &preset, &lockbits]() {
-        return preset_nvr(log, nvr, preset, lockbits);
-      },
-      // FUNC_UPDATE_NVR_S2
-      [log, &nvr, &lockbits]() { return update_nvr_s2(log, nvr, lockbits); },
-      // FUNC_READ_LOCKBITS
-      [log, &zft, &lockbits]() { return read_lockbits(log, zft, lockbits); },
-      // FUNC_SET_LOCKBITS
-      [log, &zft, &lockbits]() { return set_lockbits(log, zft, lockbits); },
-      // FUNC_ERASE_FLASH
-      [log, &zft]() { return erase_flash(log, zft); },
-      // FUNC_WRITE_FLASH
-      [log, &zft, &i_flash]() { return write_flash(log, zft, i_flash); },
-      // FUNC_READ_FLASH
-      [log, &zft, &o_flash]() { return read_flash(log, zft, o_flash); },
-      // FUNC_VERIFY_FLASH
-      [log, &zft, &o_flash]() { return verify_flash(log, zft, o_flash); },
-      // FUNC_DUMP_FLASH
-      [log, &o_flash]() { return dump_flash(log, o_flash, args.flash_of); },
-      // FUNC_DUMP_NVR
-      [log, &nvr]() { return dump_nvr(log, nvr, args.nvr_of); },
-      // FUNC_EXPORT_NVR
-      [log, &nvr]() { return export_nvr(log, args.nvr_p_of, nvr); },
-
+  // What each step reads and changes orders it against the others, device
+  // steps also keep their order on the serial link
+  task_t function_table[FUNC_MAX] = {
+      {"connect", TASK_DEVICE, [log, &zft]() { return connect(log, zft); },
+       {},
+       {}},
+      {"read flash file", TASK_HOST,
+       [log, &i_flash]() { return read_in_file(log, args.flash_if, i_flash); },
+       {},
+       {&i_flash}},
+      {"read baseline file", TASK_HOST,
+       [log, &baseline]() {
+         return read_in_file(log, args.baseline, baseline);
+       },
+       {},
+       {&baseline}},
+      {"read NVR file", TASK_HOST,
+       [log, &nvr]() { return read_in_file(log, args.nvr_if, nvr); },
+       {},
+       {&nvr}},
+      {"read NVR preset", TASK_HOST,
+       [log, &preset]() { return read_in_file(log, args.nvr_p_if, preset); },
+       {},
+       {&preset}},
+      {"read NVR", TASK_DEVICE,
+       [log, &zft, &nvr]() { return read_nvr(log, zft, nvr); },
+       {},
+       {&nvr}},
+      {"set NVR", TASK_DEVICE,
+       [log, &zft, &nvr]() { return set_nvr(log, zft, nvr); },
+       {&nvr},
+       {}},
+      {"reset NVR", TASK_HOST, [log, &nvr]() { return reset_nvr(log, nvr); },
+       {},
+       {&nvr}},
+      {"preset NVR", TASK_HOST,
+       [log, &nvr, &preset, &lockbits]() {
+         return preset_nvr(log, nvr, preset, lockbits);
+       },
+       {&preset},
+       {&nvr, &lockbits}},
+      {"update NVR S2", TASK_HOST,
+       [log, &nvr, &lockbits]() { return update_nvr_s2(log, nvr, lockbits); },
+       {},
+       {&nvr, &lockbits}},
+      {"read lockbits", TASK_DEVICE,
+       [log, &zft, &lockbits]() { return read_lockbits(log, zft, lockbits); },
+       {},
+       {&lockbits}},
+      {"set lockbits", TASK_DEVICE,
+       [log, &zft, &lockbits]() { return set_lockbits(log, zft, lockbits); },
+       {&lockbits},
+       {}},
+      {"check identical", TASK_DEVICE,
+       [log, &zft, &i_flash, &identical]() {
+         return check_identical(log, zft, i_flash, identical);
+       },
+       {&i_flash},
+       {&identical}},
+      {"erase flash", TASK_DEVICE,
+       [log, &zft]() { return erase_flash(log, zft); },
+       {},
+       {}},
+      {"write flash", TASK_DEVICE,
+       [log, &zft, &i_flash, &baseline, &job]() {
+         return write_flash(log, zft, i_flash, baseline, job);
+       },
+       {&i_flash, &baseline},
+       {&job}},
+      {"read flash", TASK_DEVICE,
+       [log, &zft, &o_flash]() { return read_flash(log, zft, o_flash); },
+       {},
+       {&o_flash}},
+      {"verify flash", TASK_DEVICE,
+       [log, &zft, &o_flash]() { return verify_flash(log, zft, o_flash); },
+       {},
+       {&o_flash}},
+      {"dump flash", TASK_HOST,
+       [log, &o_flash]() { return dump_flash(log, o_flash, args.flash_of); },
+       {&o_flash},
+       {}},
+      {"dump NVR", TASK_HOST,
+       [log, &nvr]() { return dump_nvr(log, nvr, args.nvr_of); },
+       {&nvr},
+       {}},
+      {"export NVR", TASK_HOST,
+       [log, &nvr]() { return export_nvr(log, args.nvr_p_of, nvr); },
+       {&nvr},
+       {}},
+      // Reads the chip identity
+      {"open journal", TASK_DEVICE,
+       [log, &zft, &job, &i_flash, &nvr, &lockbits, &nvr_resumed]() {
+         return open_journal(log, zft, job, i_flash, nvr, lockbits,
+                             nvr_resumed);
+       },
+       {&i_flash},
+       {&job, &nvr, &lockbits, &nvr_resumed}},
+      // The journal records device progress, so it follows the device
+      {"journal erase", TASK_DEVICE, [&job]() { return job.erased(); }, {},
+       {&job}},
+      {"journal NVR", TASK_DEVICE,
+       [&job, &nvr, &lockbits]() { return job.nvr(nvr, lockbits); },
+       {&nvr, &lockbits},
+       {&job}},
+      {"close journal", TASK_DEVICE, [&job]() { return job.finish(); }, {},
+       {&job}},
+      {"reset chip", TASK_DEVICE,
+       [log, &zft]() { return reset_chip(log, zft); },
+       {},
+       {}},
   };
 
-  std::vector<std::function<bool()>> command_list;
+  task_graph command_list(log);
+  command_list.set_phase_hook([&zft]() { zft.begin_phase(); });
+
+  // Steps only needed to bring the flash to the image, dropped at run time
+  // once the identity check passed
+  auto unless_identical = [&identical](task_t task) {
+    auto cmd = task.run;
+    task.run = [&identical, cmd]() { return identical || cmd(); };
+    task.reads.push_back(&identical);
+    return task;
+  };
+  bool nvr_modified =
+      args.nvr_if || args.update_s2 || args.nvr_p_if || args.reset;
+
+  // Steps an interrupted job already confirmed in its journal
+  auto unless_resumed = [&job](task_t task) {
+    auto cmd = task.run;
+    task.run = [&job, cmd]() { return job.resumed() || cmd(); };
+    task.reads.push_back(&job);
+    return task;
+  };
+  auto unless_nvr_resumed = [&nvr_resumed](task_t task) {
+    auto cmd = task.run;
+    task.run = [&nvr_resumed, cmd]() { return nvr_resumed || cmd(); };
+    task.reads.push_back(&nvr_resumed);
+    return task;
+  };
 
   // Always connect
-  command_list.push_back(function_table[FUNC_CONNECT]);
+  command_list.add(function_table[FUNC_CONNECT]);
 
   // Read flash input file to byte vector
   if (args.flash_if) {
-    command_list.push_back(function_table[FUNC_READ_IN_FLASH]);
+    command_list.add(function_table[FUNC_READ_IN_FLASH]);
+  }
+
+  // Read baseline image for differential flashing
+  if (args.flash_if && args.baseline) {
+    command_list.add(function_table[FUNC_READ_IN_BASELINE]);
   }
 
   // Read nvr input file to byte vector
   if (args.nvr_if) {
-    command_list.push_back(function_table[FUNC_READ_IN_NVR]);
+    command_list.add(function_table[FUNC_READ_IN_NVR]);
   }
 
   // Read NVR if we want to dump it or if flashing is requested and no nvr input
   // file is defined
   if ((args.nvr_of || args.nvr_p_if || args.nvr_p_of || args.flash_if) &&
       !args.nvr_if) {
-    command_list.push_back(function_table[FUNC_READ_NVR]);
+    command_list.add(function_table[FUNC_READ_NVR]);
+  }
+
+  // Continue an interrupted job, its NVR and lockbits are taken as they were
+  if (args.journal) {
+    command_list.add(function_table[FUNC_OPEN_JOURNAL]);
   }
 
   // Reset NVR application section
   if (args.reset) {
-    command_list.push_back(function_table[FUNC_RESET_NVR]);
+    command_list.add(unless_nvr_resumed(function_table[FUNC_RESET_NVR]));
   }
 
   // Read lockbits if flashing or nvr modification is requested
   if (args.flash_if || args.update_s2 || args.nvr_p_if) {
-    command_list.push_back(function_table[FUNC_READ_LOCKBITS]);
+    command_list.add(unless_nvr_resumed(function_table[FUNC_READ_LOCKBITS]));
   }
 
   // Apply NVR preset
   if (args.nvr_p_if) {
-    command_list.push_back(function_table[FUNC_READ_IN_NVR_PRESET]);
-    command_list.push_back(function_table[FUNC_PRESET_NVR]);
+    command_list.add(function_table[FUNC_READ_IN_NVR_PRESET]);
+    command_list.add(unless_nvr_resumed(function_table[FUNC_PRESET_NVR]));
   }
 
   // Update NVR with S2 keys
   if (args.update_s2) {
-    command_list.push_back(function_table[FUNC_UPDATE_NVR_S2]);
+    command_list.add(unless_nvr_resumed(function_table[FUNC_UPDATE_NVR_S2]));
   }
 
-  // Erase flash
-  if (args.erase || args.flash_if) {
-    command_list.push_back(function_table[FUNC_ERASE_FLASH]);
+  // Check whether the chip already holds the image
+  if (args.flash_if && args.skip_identical) {
+    command_list.add(function_table[FUNC_CHECK_IDENTICAL]);
+  }
+
+  // Erase flash, differential and region flashing erase sector by sector
+  bool sector_erase = args.diff || args.sector_count != FLASH_SECTORS;
+  if (args.erase || (args.flash_if && !sector_erase)) {
+    command_list.add(unless_identical(
+        unless_resumed(function_table[FUNC_ERASE_FLASH])));
+    if (args.journal) {
+      command_list.add(unless_identical(
+          unless_resumed(function_table[FUNC_JOURNAL_ERASE])));
+    }
   }
 
   // Write NVR if we have an input file, a modified NVR or flashing is requested
-  if (args.nvr_if || args.flash_if || args.update_s2) {
-    command_list.push_back(function_table[FUNC_SET_NVR]);
+  // with a chip erase
+  bool keeps_nvr = sector_erase && !nvr_modified;
+  if (args.nvr_if || (args.flash_if && !keeps_nvr) || args.update_s2) {
+    task_t set_nvr = unless_nvr_resumed(function_table[FUNC_SET_NVR]);
+    command_list.add(nvr_modified ? set_nvr : unless_identical(set_nvr));
+    if (args.journal) {
+      command_list.add(unless_nvr_resumed(function_table[FUNC_JOURNAL_NVR]));
+    }
   }
 
   // Flashing is requested part 2
   if (args.flash_if) {
-    command_list.push_back(function_table[FUNC_WRITE_FLASH]);
-    command_list.push_back(function_table[FUNC_READ_FLASH]);
-    command_list.push_back(function_table[FUNC_VERIFY_FLASH]);
-    command_list.push_back(function_table[FUNC_SET_LOCKBITS]);
+    command_list.add(unless_identical(function_table[FUNC_WRITE_FLASH]));
+    // Verify reads back what its policy needs, unless the flash is dumped
+    if (args.flash_of) {
+      command_list.add(function_table[FUNC_READ_FLASH]);
+    }
+    command_list.add(unless_identical(function_table[FUNC_VERIFY_FLASH]));
+    auto &set_lockbits = function_table[FUNC_SET_LOCKBITS];
+    if (!keeps_nvr) {
+      command_list.add(nvr_modified ? set_lockbits
+                                    : unless_identical(set_lockbits));
+    }
+  }
+
+  // The job is complete
+  if (args.journal) {
+    command_list.add(function_table[FUNC_CLOSE_JOURNAL]);
   }
 
   // Standalone flash read requested
   if (args.flash_of && !args.flash_if) {
-    command_list.push_back(function_table[FUNC_READ_FLASH]);
+    command_list.add(function_table[FUNC_READ_FLASH]);
   }
 
   // Dump flash to output file
   if (args.flash_of) {
-    command_list.push_back(function_table[FUNC_DUMP_FLASH]);
+    command_list.add(function_table[FUNC_DUMP_FLASH]);
   }
 
   // Dump NVR to output file
   if (args.nvr_of) {
-    command_list.push_back(function_table[FUNC_DUMP_NVR]);
+    command_list.add(function_table[FUNC_DUMP_NVR]);
   }
 
   // Export NVR to json file
   if (args.nvr_p_of) {
-    command_list.push_back(function_table[FUNC_EXPORT_NVR]);
+    command_list.add(function_table[FUNC_EXPORT_NVR]);
   }
 
-  // Run all requested commands
-  for (auto &command : command_list) {
-    if (!command()) {
-      return 1;
-    }
+  // Let the chip run the new firmware, the fixture is ready for the next one
+  if (!args.release_lines.empty()) {
+    command_list.add(function_table[FUNC_RESET_CHIP]);
   }
 
-  return 0;
+  // Run all requested commands, each device step a phase with its own budget
+  bool ok = command_list.run();
+  command_list.report();
+  zft.report_stats();
+  return ok ? 0 : 1;
 }
\ No newline at end of file
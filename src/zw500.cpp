@@ -0,0 +1,217 @@
+// Copyright (C) 2023 Matthias Beckert
+//
+// This file is part of zwave-flashing-tool.
+//
+// zwave-flashing-tool is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// zwave-flashing-tool is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with zwave-flashing-tool.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstring>
+
+#include "commands.hpp"
+#include "crc.hpp"
+#include "nvr.hpp"
+#include "zw500.hpp"
+
+constexpr std::byte erased{0xFF};
+constexpr std::byte signature[ZW500_SIGNATURE_BYTES] = {
+    std::byte{0x7F}, std::byte{0x7F}, std::byte{0x7F}, std::byte{0x7F},
+    std::byte{0x1F}, std::byte{0x05}, std::byte{0x00}};
+
+// Opcodes as sent in byte 0 of every command
+constexpr unsigned char op_enable_interface = 0xAC;
+constexpr unsigned char op_read_flash = 0x10;
+constexpr unsigned char op_read_sram = 0x06;
+constexpr unsigned char op_cont_read = 0xA0;
+constexpr unsigned char op_write_sram = 0x04;
+constexpr unsigned char op_cont_write = 0x80;
+constexpr unsigned char op_erase_chip = 0x0A;
+constexpr unsigned char op_erase_sector = 0x0B;
+constexpr unsigned char op_write_flash_sector = 0x20;
+constexpr unsigned char op_check_state = 0x7F;
+constexpr unsigned char op_read_signature = 0x30;
+constexpr unsigned char op_disable_eoos = 0xD0;
+constexpr unsigned char op_enable_eoos = 0xC0;
+constexpr unsigned char op_set_lock_bits = 0xF0;
+constexpr unsigned char op_read_lock_bits = 0xF1;
+constexpr unsigned char op_set_nvr = 0xFE;
+constexpr unsigned char op_read_nvr = 0xF2;
+constexpr unsigned char op_run_crc_check = 0xC3;
+constexpr unsigned char op_reset_chip = 0xFF;
+
+zw500::zw500(const zw500_timing_t &timing, log_t log)
+    : m_timing(timing), m_log(log), m_flash(ZW500_FLASH_SIZE, erased),
+      m_sram(ZW500_SECTOR_SIZE, erased), m_nvr(ZW500_NVR_SIZE, erased) {
+  m_lockbits.fill(erased);
+
+  // Factory calibrated NVR with a valid CRC, application area left erased
+  nvr_config_t *config =
+      reinterpret_cast<nvr_config_t *>(&m_nvr[NVR_START]);
+  config->crc_protected.rev = 1;
+  for (size_t i = 0; i < NVR_UUID_SIZE; i++) {
+    config->crc_protected.uuid[i] = static_cast<unsigned char>(0x50 + i);
+  }
+  uint16_t crc16 = crc::crc16(
+      reinterpret_cast<unsigned char *>(&config->crc_protected),
+      sizeof(config->crc_protected));
+  config->crc[0] = static_cast<unsigned char>(crc16 >> 8);
+  config->crc[1] = static_cast<unsigned char>(crc16);
+}
+
+bool zw500::enabled() { return m_enabled; }
+
+std::vector<std::byte> &zw500::flash() { return m_flash; }
+
+std::vector<std::byte> &zw500::nvr() { return m_nvr; }
+
+void zw500::_set_busy(clock::time_point now,
+                      std::chrono::microseconds duration) {
+  m_busy_until = now + duration;
+}
+
+std::byte zw500::_state_byte(clock::time_point now) {
+  std::byte state{0};
+  if (now < m_busy_until) {
+    state |= CMD_FLASH_STATE_BIT;
+  }
+  if (m_crc_run) {
+    if (now < m_crc_until) {
+      state |= CMD_CRC_BUSY_BIT;
+    } else {
+      state |= m_crc_passed ? CMD_CRC_DONE_BIT : CMD_CRC_FAILED_BIT;
+    }
+  }
+  return state;
+}
+
+std::byte zw500::_read_next() {
+  std::vector<std::byte> &memory = m_read_sram ? m_sram : m_flash;
+  std::byte value = memory[m_read_address % memory.size()];
+  m_read_address = (m_read_address + 1) % memory.size();
+  return value;
+}
+
+bool zw500::_crc_ok() {
+  // The last four bytes hold the CRC32 of everything before, big endian
+  size_t length = m_flash.size() - 4;
+  uint32_t crc32 =
+      crc::crc32(reinterpret_cast<unsigned char *>(m_flash.data()), length);
+  uint32_t stored = 0;
+  for (size_t i = 0; i < 4; i++) {
+    stored = (stored << 8) | std::to_integer<uint32_t>(m_flash[length + i]);
+  }
+  m_log->debug() << "Sim: CRC 0x" << std::hex << crc32 << ", stored 0x"
+                 << stored << std::endl;
+  return crc32 == stored;
+}
+
+void zw500::execute(const frame_t &cmd, frame_t &reply,
+                    clock::time_point now) {
+  const unsigned char op = std::to_integer<unsigned char>(cmd[0]);
+  const size_t arg1 = std::to_integer<size_t>(cmd[1]);
+  const size_t arg2 = std::to_integer<size_t>(cmd[2]);
+
+  // Write commands echo, read commands replace the last byte with data
+  reply = cmd;
+  switch (op) {
+  case op_enable_interface:
+    m_enabled = true;
+    break;
+  case op_read_flash:
+    m_read_sram = false;
+    m_read_address = (arg1 * ZW500_SECTOR_SIZE) % m_flash.size();
+    reply[3] = _read_next();
+    break;
+  case op_read_sram:
+    m_read_sram = true;
+    m_read_address = ((arg1 << 8) | arg2) % m_sram.size();
+    reply[3] = _read_next();
+    break;
+  case op_cont_read:
+    reply[1] = _read_next();
+    reply[2] = _read_next();
+    reply[3] = _read_next();
+    break;
+  case op_write_sram:
+    m_write_address = ((arg1 << 8) | arg2) % m_sram.size();
+    m_sram[m_write_address] = cmd[3];
+    m_write_address = (m_write_address + 1) % m_sram.size();
+    break;
+  case op_cont_write:
+    for (size_t i = 1; i < 4; i++) {
+      m_sram[m_write_address] = cmd[i];
+      m_write_address = (m_write_address + 1) % m_sram.size();
+    }
+    break;
+  case op_erase_chip:
+    std::fill(m_flash.begin(), m_flash.end(), erased);
+    m_lockbits.fill(erased);
+    _set_busy(now, m_timing.erase_time);
+    break;
+  case op_erase_sector: {
+    auto sector = m_flash.begin() +
+                  (arg1 * ZW500_SECTOR_SIZE) % m_flash.size();
+    std::fill(sector, sector + ZW500_SECTOR_SIZE, erased);
+    _set_busy(now, m_timing.erase_time);
+    break;
+  }
+  case op_write_flash_sector: {
+    // Programming can only clear bits, the sector buffer is erased after
+    size_t base = (arg1 * ZW500_SECTOR_SIZE) % m_flash.size();
+    for (size_t i = 0; i < ZW500_SECTOR_SIZE; i++) {
+      m_flash[base + i] &= m_sram[i];
+    }
+    std::fill(m_sram.begin(), m_sram.end(), erased);
+    _set_busy(now, m_timing.program_time);
+    break;
+  }
+  case op_check_state:
+    reply[3] = _state_byte(now);
+    break;
+  case op_read_signature:
+    reply[3] = signature[arg1 % ZW500_SIGNATURE_BYTES];
+    break;
+  case op_disable_eoos:
+  case op_enable_eoos:
+    break;
+  case op_set_lock_bits:
+    if (arg1 < ZW500_LOCK_BYTES) {
+      m_lockbits[arg1] &= cmd[3];
+    }
+    _set_busy(now, m_timing.program_time);
+    break;
+  case op_read_lock_bits:
+    reply[3] = (arg1 < ZW500_LOCK_BYTES) ? m_lockbits[arg1] : erased;
+    break;
+  case op_set_nvr:
+    m_nvr[arg2] = cmd[3];
+    break;
+  case op_read_nvr:
+    reply[3] = m_nvr[arg2];
+    break;
+  case op_run_crc_check:
+    m_crc_run = true;
+    m_crc_passed = _crc_ok();
+    m_crc_until = now + m_timing.crc_time;
+    break;
+  case op_reset_chip:
+    m_enabled = false;
+    m_crc_run = false;
+    std::fill(m_sram.begin(), m_sram.end(), erased);
+    break;
+  default:
+    m_log->warn() << "Sim: unknown command 0x" << std::hex
+                  << static_cast<int>(op) << std::endl;
+    break;
+  }
+}